@@ -6,11 +6,31 @@ ALLES_LATENCY_MS = 1000
 UDP_PORT = 9294
 sock = 0
 
+# Set by record(): a file we log everything we send to, for rendering offline with alles -r
+record_file = None
+
 def transmit(message, retries=1):
+    if(record_file is not None):
+        record_file.write("%d %s\n" % (millis(), message))
     for x in range(retries):
         get_sock().sendto(message.encode('ascii'), get_multicast_group())
 
+def record(filename=None):
+    # Log what we send from now on (each line is the time we sent it and the message), or stop with no filename.
+    # ./alles -r filename -w out.wav then renders it without a sound card, faster than realtime.
+    global record_file
+    if(record_file is not None):
+        record_file.close()
+        record_file = None
+    if(filename is not None):
+        record_file = open(filename, "w")
+
+# Set by use_mesh_time(): times are on the mesh time master's clock, which messages mark with a leading @
+mesh_offset = None
+
 def alles_send(message, retries=1):
+    if(mesh_offset is not None):
+        message = '@' + message
     transmit(message,retries=retries)
 
 # We override AMY's send function to send out to the mesh instead of locally
@@ -82,6 +102,17 @@ def disconnect():
 
 
 
+def clients(ids):
+    # A client= value that reaches exactly these client_ids in one message, e.g. clients([2,5,9,10,11]) is "2,5,9-11"
+    ids = sorted(set(ids))
+    runs = []
+    for i in ids:
+        if(runs and runs[-1][1] == i - 1):
+            runs[-1][1] = i
+        else:
+            runs.append([i, i])
+    return ",".join("%d" % a if a == b else "%d-%d" % (a, b) for (a, b) in runs)
+
 def decode_battery_mask(mask):
     state = "unknown"
     level = 0
@@ -95,50 +126,85 @@ def decode_battery_mask(mask):
     return(state, level)
 
 
-def sync(count=10, delay_ms=100):
+def sync(count=10, delay_ms=100, window_ms=0, aggregate=False, percentile=None):
     global sock
     import re
     # Sends sync packets to all the listeners so they can correct / get the time
+    # With window_ms, synths answer at a random point in that window instead of all at once, and tell us how long
+    # they held the reply so the round trip still comes out right. With aggregate, they hand their replies to the
+    # mesh's time master, which sends them on together (those round trips include the extra hop, so the offsets
+    # from them are rougher). With percentile, synths recommend a latency that gets that percent of messages
+    # to them in time (see calibrate_latency()).
     clients = {}
     client_map = {}
     battery_map = {}
+    ppm_map = {}
+    relayed_map = {}
+    latency_map = {}
+    free_map = {}
+    load_map = {}
     start_time = millis()
     last_sent = 0
     time_sent = {}
     rtt = {}
+    offset = {}
     i = 0
     while 1:
         tic = millis() - start_time
         if((tic - last_sent) > delay_ms):
             time_sent[i] = millis()
             #print ("sending %d at %d" % (i, time_sent[i]))
-            output = "U%di%dZ" % (time_sent[i], i)
-            sock.sendto(output.encode('ascii'), get_multicast_group())
+            output = "U%di%d" % (time_sent[i], i)
+            if(window_ms): output = output + "w%d" % (window_ms)
+            if(aggregate): output = output + "x1"
+            if(percentile is not None): output = output + "P%g" % (percentile)
+            sock.sendto((output + "Z").encode('ascii'), get_multicast_group())
             i = i + 1
             last_sent = tic
         try:
-            data, address = sock.recvfrom(1024)
-            data = data.decode('ascii')
-            #print("received %s from %s" % (data, address))
-            if(data[0] == '_'):
-                data = data[:-1]
+            data, address = sock.recvfrom(4096)
+            t4 = millis()
+            # The time master sends relayed replies several to a packet
+            for data in data.decode('ascii').split('Z'):
+                if(len(data) == 0 or data[0] != '_'): continue
+                fields = dict(re.findall(r'([A-Za-z])([^A-Za-z]*)', data[1:]))
                 try:
-                    [_, client_time, sync_index, client_id, ipv4, battery] = re.split(r'[Uigry]',data)
-                except ValueError:
+                    [client_time, sync_index, client_id, ipv4, battery] = [fields[k] for k in 'Uigry']
+                except KeyError:
                     print("What! %s" % (data))
+                    continue
                 if(int(sync_index) <= i): # skip old ones from a previous run
                     #print ("recvd at %d:  %s %s %s %s" % (millis(), client_time, sync_index, client_id, ipv4))
                     # ping sets client index to -1, so make sure this is a sync response 
                     if(int(sync_index) >= 0):
+                        # Relayed replies from the master have x1 and the master's own hold in q; skip the copy the node unicast
+                        if(fields.get('x') == '1' and 'q' not in fields): continue
                         client_map[int(ipv4)] = int(client_id)
                         battery_map[int(ipv4)] = battery
+                        ppm_map[int(ipv4)] = float(fields.get('p', 0))
+                        relayed_map[int(ipv4)] = 'q' in fields
+                        latency_map[int(ipv4)] = int(fields.get('l', -1))
+                        free_map[int(ipv4)] = int(fields.get('o', -1))
+                        load_map[int(ipv4)] = {"load": float(fields['c']) if 'c' in fields else None,
+                            "peak": float(fields['k']) if 'k' in fields else None, "queue": int(fields.get('s', -1)),
+                            "imbalance": float(fields['b']) if 'b' in fields else None,
+                            "late": int(fields.get('n', -1)), "dropped": int(fields.get('d', -1))}
+                        # How long the reply sat on the synth (and the master), in ms
+                        held = (float(fields.get('h', 0)) + float(fields.get('q', 0))) / 1000.0
                         rtt[int(ipv4)] = rtt.get(int(ipv4), {})
-                        rtt[int(ipv4)][int(sync_index)] = millis()-time_sent[int(sync_index)]
+                        rtt[int(ipv4)][int(sync_index)] = t4-time_sent[int(sync_index)] - held
+                        # The node stamps its reply as it sends it, h after it got our request: that's t3, and t2 is t3 - h.
+                        # The master's hold comes off our receive time.
+                        t3 = float(client_time)
+                        t2 = t3 - float(fields.get('h', 0)) / 1000.0
+                        t4_sent = t4 - float(fields.get('q', 0)) / 1000.0
+                        offset[int(ipv4)] = offset.get(int(ipv4), {})
+                        offset[int(ipv4)][int(sync_index)] = ((t2 - time_sent[int(sync_index)]) + (t3 - t4_sent)) / 2.0
         except socket.error:
             pass
 
         # Wait for at least (client latency) to get any straggling UDP packets back 
-        delay_period = 1 + (ALLES_LATENCY_MS / delay_ms)
+        delay_period = 1 + ((ALLES_LATENCY_MS + window_ms) / delay_ms)
         if((i-delay_period) > count):
             break
     # Compute average rtt in ms and reliability (number of rt packets we got)
@@ -153,12 +219,114 @@ def sync(count=10, delay_ms=100):
         clients[client_map[ipv4]] = {}
         clients[client_map[ipv4]]["reliability"] = float(hit)/float(count)
         clients[client_map[ipv4]]["avg_rtt"] = float(total_rtt_ms) / float(hit) # todo compute std.dev
+        # Like NTP, trust the offset from the exchange with the smallest round trip
+        best = min(rtt[ipv4].keys(), key=lambda k: rtt[ipv4][k])
+        clients[client_map[ipv4]]["min_rtt"] = rtt[ipv4][best]
+        clients[client_map[ipv4]]["offset"] = offset[ipv4][best]
         clients[client_map[ipv4]]["ipv4"] = ipv4
         clients[client_map[ipv4]]["battery"] = decode_battery_mask(int(battery_map[ipv4]))
+        clients[client_map[ipv4]]["ppm"] = ppm_map[ipv4]
+        clients[client_map[ipv4]]["relayed"] = relayed_map[ipv4]
+        # The latency this synth would like, or None if it hasn't seen enough traffic to say
+        clients[client_map[ipv4]]["latency"] = latency_map[ipv4] if latency_map[ipv4] >= 0 else None
+        # Oscillators it had free, or None if its firmware doesn't say
+        clients[client_map[ipv4]]["free"] = free_map[ipv4] if free_map[ipv4] >= 0 else None
+        # Render load (average and longest block, % of its playback time), how uneven split blocks were,
+        # event queue peak, late and dropped events
+        clients[client_map[ipv4]].update(load_map[ipv4])
     # Return this as a map for future use
     return clients
 
 
+# Sender-side voice allocation: client_id -> what it had free at the last update_voices(), and when the notes
+# we have given it since will have finished
+voices = {}
+
+def update_voices(clients=None):
+    # Start placing notes from what each synth says it has free, from a fresh sync() if not given one
+    global voices
+    if(clients is None): clients = sync(count=3)
+    voices = {}
+    for (client_id, info) in clients.items():
+        if(info.get("free") is not None): voices[client_id] = {"free": info["free"], "until": []}
+    return len(voices)
+
+def voice(duration_ms=1000):
+    # The synth with the most room for a note lasting duration_ms, as a client= value: what it had free, less our
+    # notes still sounding on it. Before update_voices() (or if no synth reported) it's "*", which leaves the
+    # choice to the mesh. e.g. alles.send(client=alles.voice(500), osc=0, wave=alles.SINE, note=60, vel=1)
+    now = millis()
+    best = None
+    best_room = 0
+    for (client_id, v) in voices.items():
+        v["until"] = [t for t in v["until"] if t > now]
+        room = v["free"] - len(v["until"])
+        if(best is None or room > best_room):
+            best = client_id
+            best_room = room
+    if(best is None): return "*"
+    voices[best]["until"].append(now + duration_ms)
+    return best
+
+def set_latency(latency_ms, retries=3):
+    # Sets the latency on every synth. It rides on a sync request, which is the one message they don't hand to AMY
+    global ALLES_LATENCY_MS
+    transmit("U%di0L%dw200Z" % (millis(), latency_ms), retries=retries)
+    ALLES_LATENCY_MS = latency_ms
+
+def calibrate_latency(percentile=99.9, margin_ms=0, apply=False, count=20):
+    # Asks every synth what latency would have got percentile percent of what they've received in time to play.
+    # They measure this from all the timed traffic they see, so run it after the mesh has been busy for a while.
+    # Returns the largest answer plus margin_ms, and sets it on the mesh if apply is True.
+    clients = sync(count=count, window_ms=200, percentile=percentile)
+    wanted = [c["latency"] for c in clients.values() if c["latency"] is not None]
+    if(len(wanted) == 0):
+        print("No synth has seen enough traffic to recommend a latency yet")
+        return None
+    latency_ms = max(wanted) + margin_ms
+    print("%d of %d synths answered, p%g latency is %d ms" % (len(wanted), len(clients), percentile, latency_ms))
+    if(apply):
+        set_latency(latency_ms)
+    return latency_ms
+
+def mesh_sync(seconds=3):
+    # Listens for the time master's beacons (sent every second) and returns the mesh clock minus ours, in ms.
+    # Like sync(), the beacon that reached us fastest gives the best offset, so we keep the largest one.
+    import re
+    best = None
+    start = time.time()
+    while time.time() - start < seconds:
+        try:
+            data, address = sock.recvfrom(1024)
+        except socket.error:
+            time.sleep(0.001)
+            continue
+        t = millis()
+        for message in data.decode('ascii').split('Z'):
+            if(not message.startswith('_')): continue
+            fields = dict(re.findall(r'([A-Za-z])([^A-Za-z]*)', message[1:]))
+            if(fields.get('i') == '-2' and 'U' in fields):
+                offset = float(fields['U']) - t
+                if(best is None or offset > best): best = offset
+    return best
+
+def mesh_millis():
+    return int(millis() + mesh_offset)
+
+def use_mesh_time(on=True, seconds=3):
+    # Time everything we send on the mesh's clock, so every synth plays it together without us calling sync()
+    global mesh_offset
+    if(on):
+        offset = mesh_sync(seconds)
+        if(offset is None):
+            print("No time master beacons heard, staying on our own clock")
+            return False
+        mesh_offset = offset
+        amy.insert_time = mesh_millis
+    else:
+        mesh_offset = None
+        amy.insert_time = amy.millis
+    return True
 
 def battery_test():
     tic = time.time()
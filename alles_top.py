@@ -0,0 +1,125 @@
+# alles_top.py
+# A live table of every synth on the mesh: render load, event queue, late and dropped events.
+# It reads the load fields the synths put in their pings and sync replies, and sends a sync request
+# every interval so it hears from all of them that often. The requests carry m1, so the synths answer
+# without taking them as clock sync from us. Needs only python, not AMY.
+#   python3 alles_top.py [-i local ip] [-n interval seconds] [--passive]
+import socket, datetime, sys, re, argparse
+
+UDP_PORT = 9294
+MULTICAST_GROUP = '232.10.11.12'
+AMY_EVENT_FIFO_LEN = 400
+WARN_PEAK = 80.0 # % of a block's playback time spent rendering it
+
+def millis():
+    # ms since midnight, like amy.millis() that alles.py sends, in case a synth is too old to know m1
+    d = datetime.datetime.now()
+    return int((d - d.replace(hour=0, minute=0, second=0, microsecond=0)).total_seconds() * 1000)
+
+def connect(local_ip=None):
+    if(local_ip is None):
+        s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        try:
+            s.connect(('10.255.255.255', 1))
+            local_ip = s.getsockname()[0]
+        except Exception:
+            local_ip = "127.0.0.1"
+        finally:
+            s.close()
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    try:
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+    except AttributeError:
+        pass
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, 255)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_LOOP, 1)
+    sock.bind(('', UDP_PORT))
+    sock.setsockopt(socket.SOL_IP, socket.IP_MULTICAST_IF, socket.inet_aton(local_ip))
+    mreq = socket.inet_aton(MULTICAST_GROUP) + socket.inet_aton(local_ip)
+    sock.setsockopt(socket.SOL_IP, socket.IP_ADD_MEMBERSHIP, mreq)
+    sock.settimeout(0.1)
+    return sock
+
+def update(nodes, address, message, now):
+    fields = dict(re.findall(r'([A-Za-z])([^A-Za-z]*)', message[1:]))
+    if('r' not in fields or 'g' not in fields): return
+    # Relayed replies come from the master's address, so key on the tag and keep the address we saw first
+    key = int(fields['r'])
+    node = nodes.setdefault(key, {"address": address[0], "late_rate": 0.0, "drop_rate": 0.0})
+    if(fields.get('x') == '1' and 'q' not in fields): return
+    if(fields.get('x') != '1'): node["address"] = address[0]
+    late = int(fields.get('n', -1))
+    dropped = int(fields.get('d', -1))
+    # Rates since the last time we heard from it
+    if(node.get("late", -1) >= 0 and late >= node["late"] and now > node["seen"]):
+        node["late_rate"] = (late - node["late"]) * 1000.0 / (now - node["seen"])
+    if(node.get("dropped", -1) >= 0 and dropped >= node["dropped"] and now > node["seen"]):
+        node["drop_rate"] = (dropped - node["dropped"]) * 1000.0 / (now - node["seen"])
+    node["client_id"] = int(fields['g'])
+    node["load"] = float(fields['c']) if 'c' in fields else None
+    node["peak"] = float(fields['k']) if 'k' in fields else None
+    node["imbalance"] = float(fields['b']) if 'b' in fields else None
+    node["queue"] = int(fields.get('s', -1))
+    node["late"] = late
+    node["dropped"] = dropped
+    node["free"] = int(fields.get('o', -1))
+    node["latency"] = int(fields.get('l', -1))
+    node["ppm"] = float(fields.get('p', 0))
+    node["seen"] = now
+
+def show(nodes, now):
+    def opt(v, fmt):
+        return fmt % v if v is not None and v >= 0 else "-"
+    lines = ["\033[H\033[2J%-4s %-15s %4s %7s %7s %7s %9s %5s %8s %7s %8s %6s %5s" %
+        ("id", "address", "tag", "load%", "peak%", "split%", "queue", "free", "late", "late/s", "dropped", "lat", "seen")]
+    for (key, n) in sorted(nodes.items(), key=lambda kv: kv[1].get("client_id", 999)):
+        if("seen" not in n): continue
+        age = (now - n["seen"]) / 1000.0
+        warn = (n["peak"] is not None and n["peak"] >= WARN_PEAK) or n["drop_rate"] > 0 or n["late_rate"] > 0 or \
+            n["queue"] >= AMY_EVENT_FIFO_LEN * 3 / 4
+        lines.append("%-4d %-15s %4d %7s %7s %7s %9s %5s %8s %7.1f %8s %6s %4.0fs%s" % (
+            n["client_id"], n["address"], key, opt(n["load"], "%.1f"), opt(n["peak"], "%.1f"), opt(n["imbalance"], "%.1f"),
+            "%d/%d" % (n["queue"], AMY_EVENT_FIFO_LEN) if n["queue"] >= 0 else "-", opt(n["free"], "%d"),
+            opt(n["late"], "%d"), n["late_rate"], opt(n["dropped"], "%d"), opt(n["latency"], "%d"), age,
+            "  <<" if warn else ""))
+    lines.append("\n%d synths. load/peak are the average and longest render as a percent of the block; '-' if the synth doesn't time it,\n"
+        "or shares its render with the first synth in the same process (alles -v).\n"
+        "split is how much longer the slowest core or thread took than the average one, on synths that split the block." % len(lines[1:]))
+    sys.stdout.write("\n".join(lines) + "\n")
+    sys.stdout.flush()
+
+def main():
+    parser = argparse.ArgumentParser(description="Live load table for an alles mesh")
+    parser.add_argument("-i", dest="local_ip", default=None, help="multicast interface ip address")
+    parser.add_argument("-n", dest="interval", type=float, default=2.0, help="seconds between refreshes")
+    parser.add_argument("--passive", action="store_true", help="don't send sync requests, just listen to pings")
+    args = parser.parse_args()
+    sock = connect(args.local_ip)
+    nodes = {}
+    index = 0
+    next_request = 0
+    next_show = 0
+    while True:
+        now = millis()
+        if(not args.passive and now >= next_request):
+            # Let the replies spread over half the interval rather than all landing at once
+            window = int(min(args.interval * 500, 500))
+            sock.sendto(("U%di%dw%dm1Z" % (now, index % 100, window)).encode('ascii'), (MULTICAST_GROUP, UDP_PORT))
+            index = index + 1
+            next_request = now + int(args.interval * 1000)
+        if(now >= next_show):
+            show(nodes, now)
+            next_show = now + int(args.interval * 1000)
+        try:
+            data, address = sock.recvfrom(4096)
+        except socket.timeout:
+            continue
+        for message in data.decode('ascii', 'replace').split('Z'):
+            if(len(message) and message[0] == '_'): update(nodes, address, message, millis())
+
+if __name__ == "__main__":
+    try:
+        main()
+    except KeyboardInterrupt:
+        pass
@@ -1,181 +1,1367 @@
 #include "alles.h"
+#include <stdatomic.h>
 
 
 extern uint8_t battery_mask;
-extern uint8_t ipv4_quartet;
 extern char githash[8];
-int16_t client_id;
-int64_t clocks[255];
-int64_t ping_times[255];
-uint8_t alive = 1;
+uint32_t message_sender = 0; // address the message being parsed came from, set by the listener
 
-int32_t computed_delta = 0 ; // can be negative no prob, but usually host is larger # than client
-uint8_t computed_delta_set = 0; // have we set a delta yet?
+struct alles_node alles_first_node;
+struct alles_node *me = &alles_first_node;
+struct alles_node *alles_nodes[ALLES_MAX_NODES] = { &alles_first_node };
+uint16_t alles_node_count = 1;
+struct alles_load alles_load; // the process renders once for all its nodes
+struct alles_partition alles_partition;
 
-extern int64_t last_ping_time;
+static void alles_node_init() {
+    me->client_id = -1; // for now
+    me->osc_base = 0;
+    me->osc_count = AMY_OSCS;
+    me->alive = 0;
+    me->members_older = 0;
+    me->members_stamped = 0;
+    me->boot_stamp = ALLES_STAMP_NONE;
+    me->listen_start = -1;
+    me->beacon_heard = 0;
+    me->member_wheel_tick = 0;
+    me->member_free = MEMBER_NONE;
+    for(uint16_t i=0;i<ALLES_MAX_MEMBERS;i++) {
+        me->members[i].live = 0;
+        me->members[i].chain = me->member_free;
+        me->member_free = i;
+        me->member_buckets[i] = MEMBER_NONE;
+    }
+    for(uint16_t i=0;i<ALLES_MEMBER_WHEEL_SLOTS;i++) me->member_wheel[i] = MEMBER_NONE;
+    for(uint8_t i=0;i<ALLES_SENDERS;i++) me->senders[i].used = 0;
+    me->sync_ppm = 0;
+    clock_estimator_init(&me->mesh_clock);
+    latency_stats_init(&me->latency_stats);
+    me->latency_target = ALLES_LATENCY_TARGET;
+    me->latency_recommended = -1;
+    me->latency_recommended_at = 0;
+    me->mesh_master = MEMBER_NONE;
+    me->last_beacon_time = 0;
+    me->next_ping_time = 0;
+    me->ping_fast_until = 0;
+    me->ping_seed = 0;
+    for(uint8_t i=0;i<ALLES_SYNC_PENDING;i++) me->sync_pending[i].send_time = 0;
+    me->sync_relay_count = 0;
+    me->sync_relay_flush = 0;
+}
 
 amy_err_t sync_init() {
-    client_id = -1; // for now
-    for(uint8_t i=0;i<255;i++) { clocks[i] = 0; ping_times[i] = 0; }
+    me = &alles_first_node;
+    alles_nodes[0] = me;
+    alles_node_count = 1;
+    alles_node_init();
+    memset(&alles_load, 0, sizeof(alles_load));
+    parse_cache_init(&parse_cache);
     return AMY_OK;
 }
 
+// A node that isn't one of this process's, for the simulator, which runs hundreds of them. NULL if out of memory.
+struct alles_node *alles_node_new(uint32_t addr, uint8_t quartet) {
+    struct alles_node *was = me;
+    me = (struct alles_node *)malloc(sizeof(struct alles_node));
+    if(me == NULL) {
+        fprintf(stderr, "no memory for another node (%d bytes)\n", (int)sizeof(struct alles_node));
+        me = was;
+        return NULL;
+    }
+    alles_node_init();
+    me->ipv4_address = addr;
+    me->ipv4_quartet = quartet;
+    struct alles_node *n = me;
+    me = was;
+    return n;
+}
+
+// Be node n, and only n, until the next call
+void alles_node_select(struct alles_node *n) {
+    me = n;
+    alles_nodes[0] = n;
+    alles_node_count = 1;
+}
+
+// Run n synths in this process instead of one. Each gets the next tag up and an even share of the oscillators.
+void alles_add_nodes(uint16_t n) {
+    if(n > ALLES_MAX_NODES) n = ALLES_MAX_NODES;
+    if(n > AMY_OSCS) n = AMY_OSCS;
+    while(alles_node_count < n) {
+        struct alles_node *node = alles_node_new(alles_nodes[0]->ipv4_address, alles_nodes[0]->ipv4_quartet + alles_node_count);
+        if(node == NULL) {
+            fprintf(stderr, "stopping at %d virtual synths\n", alles_node_count);
+            break;
+        }
+        alles_nodes[alles_node_count++] = node;
+    }
+    for(uint16_t i=0;i<alles_node_count;i++) {
+        alles_nodes[i]->osc_count = AMY_OSCS / alles_node_count;
+        alles_nodes[i]->osc_base = i * alles_nodes[i]->osc_count;
+    }
+}
+
+// Who we are on the network, once the platform knows. Virtual synths take the tags after ours.
+void alles_set_address(uint32_t addr, uint8_t quartet) {
+    for(uint16_t i=0;i<alles_node_count;i++) {
+        alles_nodes[i]->ipv4_address = addr;
+        alles_nodes[i]->ipv4_quartet = quartet + i;
+    }
+}
+
+// The address bytes are in network order, so this orders nodes the same way on every platform
+static uint64_t member_key(uint32_t addr, uint8_t ipv4) {
+    const uint8_t *a = (const uint8_t *)&addr;
+    return ((uint64_t)a[0] << 32) | ((uint64_t)a[1] << 24) | ((uint64_t)a[2] << 16) | ((uint64_t)a[3] << 8) | ipv4;
+}
+
+static uint16_t member_bucket(uint64_t key) {
+    return (uint16_t)(((key * 0x9E3779B97F4A7C15ull) >> 32) % ALLES_MAX_MEMBERS);
+}
+
+static uint16_t member_find(uint64_t key) {
+    uint16_t i = me->member_buckets[member_bucket(key)];
+    while(i != MEMBER_NONE && me->members[i].key != key) i = me->members[i].chain;
+    return i;
+}
+
+// Oldest first: by the boot stamps they advertise, which every node sees the same, with ties going to the lower
+// key. Anyone who has stamped ranks before anyone who hasn't, and among those our estimate of their boot will do.
+static uint8_t member_rank_older(int64_t stamp_a, int64_t boot_a, uint64_t key_a, int64_t stamp_b, int64_t boot_b, uint64_t key_b) {
+    if((stamp_a == ALLES_STAMP_NONE) != (stamp_b == ALLES_STAMP_NONE)) return stamp_a != ALLES_STAMP_NONE;
+    if(stamp_a != ALLES_STAMP_NONE) return stamp_a < stamp_b || (stamp_a == stamp_b && key_a < key_b);
+    return boot_a < boot_b || (boot_a == boot_b && key_a < key_b);
+}
+
+// Does member i rank before us? We booted at 0 on our own clock.
+static uint8_t member_is_older(uint16_t i) {
+    uint64_t my_key = member_key(me->ipv4_address, me->ipv4_quartet);
+    struct member *m = &me->members[i];
+    if(m->key == my_key) return 0;
+    return member_rank_older(m->stamp, m->boot, m->key, me->boot_stamp, 0, my_key);
+}
+
+// Same ordering between two other members
+static uint8_t member_is_older_than(uint16_t i, uint16_t j) {
+    struct member *a = &me->members[i], *b = &me->members[j];
+    return member_rank_older(a->stamp, a->boot, a->key, b->stamp, b->boot, b->key);
+}
+
+static void member_unlink(uint16_t i) {
+    struct member *m = &me->members[i];
+    if(m->prev != MEMBER_NONE) me->members[m->prev].next = m->next; else me->member_wheel[m->slot] = m->next;
+    if(m->next != MEMBER_NONE) me->members[m->next].prev = m->prev;
+}
 
+static void member_remove(uint16_t i) {
+    //printf("[ipv4 %d client %d] member %d is dead, ping time was %lld.\n", ipv4_quartet, client_id, members[i].ipv4, members[i].ping_time);
+    member_unlink(i);
+    if(me->members[i].older) me->members_older--;
+    if(me->members[i].stamp != ALLES_STAMP_NONE) me->members_stamped--;
+    me->members[i].live = 0;
+    me->alive--;
+    if(me->mesh_master == i) me->mesh_master = MEMBER_NONE;
+    // Take it out of its bucket and give the entry back
+    uint16_t *link = &me->member_buckets[member_bucket(me->members[i].key)];
+    while(*link != i) link = &me->members[*link].chain;
+    *link = me->members[i].chain;
+    me->members[i].chain = me->member_free;
+    me->member_free = i;
+}
 
-void update_map(int16_t client, uint8_t ipv4, int64_t time) {
+static uint16_t member_update(uint64_t key, uint8_t ipv4, int64_t clock, int64_t expire_time, int16_t free_oscs, int64_t stamp, int64_t my_sysclock) {
+    uint16_t i = member_find(key);
+    uint8_t joined = 0;
+    if(i != MEMBER_NONE) {
+        member_unlink(i);
+        if(me->members[i].older) me->members_older--;
+    } else {
+        if(me->member_free == MEMBER_NONE) return MEMBER_NONE; // table is full, they'll get in when someone leaves
+        i = me->member_free;
+        me->member_free = me->members[i].chain;
+        uint16_t b = member_bucket(key);
+        me->members[i].chain = me->member_buckets[b];
+        me->member_buckets[b] = i;
+        me->members[i].key = key;
+        me->members[i].live = 1;
+        me->members[i].free_oscs = -1;
+        me->members[i].stamp = ALLES_STAMP_NONE;
+        me->alive++;
+        joined = 1;
+    }
+    struct member *m = &me->members[i];
+    m->ipv4 = ipv4;
+    m->clock = clock;
+    m->ping_time = my_sysclock;
+    // Network delay only ever makes them look younger, so keep the earliest boot we've worked out
+    int64_t boot = my_sysclock - clock;
+    if(joined || boot < m->boot || boot - m->boot > ALLES_MEMBER_REBOOT_MS) m->boot = boot;
+    m->expire_time = expire_time;
+    // A stamp only changes if they rebooted
+    if(stamp != ALLES_STAMP_NONE && stamp != m->stamp) {
+        if(m->stamp == ALLES_STAMP_NONE) me->members_stamped++;
+        m->stamp = stamp;
+    }
+    if(free_oscs >= 0) m->free_oscs = free_oscs;
+    m->older = member_is_older(i);
+    if(m->older) me->members_older++;
+    m->slot = (expire_time / ALLES_MEMBER_WHEEL_TICK_MS) % ALLES_MEMBER_WHEEL_SLOTS;
+    m->prev = MEMBER_NONE;
+    m->next = me->member_wheel[m->slot];
+    if(m->next != MEMBER_NONE) me->members[m->next].prev = i;
+    me->member_wheel[m->slot] = i;
+    return i;
+}
+
+// Expire everyone whose expiry tick has fully passed. Expiry can lag by up to one tick.
+static void member_expire(int64_t my_sysclock) {
+    int64_t tick = my_sysclock / ALLES_MEMBER_WHEEL_TICK_MS;
+    // After a long gap every slot only needs one look
+    if(tick - me->member_wheel_tick > ALLES_MEMBER_WHEEL_SLOTS) me->member_wheel_tick = tick - ALLES_MEMBER_WHEEL_SLOTS - 1;
+    for(int64_t t=me->member_wheel_tick+1; t<tick; t++) {
+        uint16_t i = me->member_wheel[t % ALLES_MEMBER_WHEEL_SLOTS];
+        while(i != MEMBER_NONE) {
+            uint16_t next = me->members[i].next;
+            if(my_sysclock >= me->members[i].expire_time) member_remove(i);
+            i = next;
+        }
+    }
+    if(tick - 1 > me->member_wheel_tick) me->member_wheel_tick = tick - 1;
+}
+
+// Work out everyone's older flag again, after our own rank changed
+static void members_rerank() {
+    me->members_older = 0;
+    for(uint16_t s=0;s<ALLES_MEMBER_WHEEL_SLOTS;s++) {
+        for(uint16_t i=me->member_wheel[s];i!=MEMBER_NONE;i=me->members[i].next) {
+            me->members[i].older = member_is_older(i);
+            if(me->members[i].older) me->members_older++;
+        }
+    }
+}
+
+// Is our key the lowest of everyone we've heard from?
+static uint8_t members_lowest_key_is_me() {
+    uint64_t my_key = member_key(me->ipv4_address, me->ipv4_quartet);
+    for(uint16_t s=0;s<ALLES_MEMBER_WHEEL_SLOTS;s++) {
+        for(uint16_t i=me->member_wheel[s];i!=MEMBER_NONE;i=me->members[i].next) {
+            if(me->members[i].key < my_key) return 0;
+        }
+    }
+    return 1;
+}
+
+// Work out when we booted on the mesh clock, once we can: from the master's beacons if there is one, or if
+// nobody has a mesh clock yet and we have the lowest address around, by starting it ourselves at our boot.
+// The wait runs from our first poll, not from boot: on the ESP32 AMY starts well before WiFi does, and a node
+// joining a running mesh has to hear it before deciding there isn't one.
+static void alles_boot_stamp(int64_t sysclock) {
+    if(me->boot_stamp != ALLES_STAMP_NONE) return;
+    if(me->listen_start < 0) me->listen_start = sysclock;
+    if(sysclock - me->listen_start < ALLES_BOOT_STAMP_WAIT_MS) return;
+    if(me->mesh_master != MEMBER_NONE && me->mesh_clock.count >= ALLES_BOOT_STAMP_BEACONS) {
+        // The mesh clock minus ours is the mesh time of our 0
+        me->boot_stamp = clock_estimator_delta(&me->mesh_clock, alles_sysclock_us()) / 1000;
+    } else if(!me->beacon_heard && me->members_stamped == 0 && members_lowest_key_is_me()) {
+        me->boot_stamp = 0;
+    } else {
+        return;
+    }
+    printf("[%d] booted at %" PRIi64 " ms on the mesh clock\n", me->ipv4_quartet, me->boot_stamp);
+    members_rerank();
+    update_map(me->client_id, me->ipv4_address, me->ipv4_quartet, sysclock, -1, -1, me->boot_stamp);
+}
+
+// Intervals between pings: steady ones grow with the mesh, fast ones are for while membership changes
+int64_t ping_interval(uint16_t nodes, uint8_t fast) {
+    int64_t interval = (int64_t)nodes * (fast ? ALLES_PING_FAST_MS_PER_NODE : ALLES_PING_MS_PER_NODE);
+    int64_t shortest = fast ? ALLES_PING_FAST_MS : PING_TIME_MS;
+    int64_t longest = fast ? PING_TIME_MS : ALLES_PING_MAX_MS;
+    if(interval < shortest) interval = shortest;
+    if(interval > longest) interval = longest;
+    return interval;
+}
+
+// Spread an interval by ALLES_PING_JITTER either way, using a random r
+int64_t ping_jitter(int64_t interval, uint32_t r) {
+    return interval + (int64_t)((float)interval * ALLES_PING_JITTER * ((float)(r % 2001) / 1000.0f - 1.0f));
+}
+
+static uint32_t ping_random() {
+    // xorshift32, seeded per node so nodes that boot together still pick different times
+    if(me->ping_seed == 0) me->ping_seed = (uint32_t)(member_key(me->ipv4_address, me->ipv4_quartet) * 2654435761u) ^ (uint32_t)alles_sysclock_us() ^ 0x9E3779B9u;
+    if(me->ping_seed == 0) me->ping_seed = 1;
+    me->ping_seed ^= me->ping_seed << 13;
+    me->ping_seed ^= me->ping_seed >> 17;
+    me->ping_seed ^= me->ping_seed << 5;
+    return me->ping_seed;
+}
+
+// What we put in e: how long until our next ping
+static int32_t ping_every(int64_t sysclock) {
+    return me->next_ping_time > sysclock ? (int32_t)(me->next_ping_time - sysclock) : PING_TIME_MS;
+}
+
+// Someone joined or left: ping soon, and keep pinging fast until things settle
+static void ping_membership_changed(int64_t my_sysclock) {
+    me->ping_fast_until = my_sysclock + ALLES_PING_SETTLE_MS;
+    int64_t fast = ping_interval(me->alive, 1);
+    if(me->next_ping_time > my_sysclock + fast) me->next_ping_time = my_sysclock + ping_random() % fast;
+}
+
+void update_map(int16_t client, uint32_t addr, uint8_t ipv4, int64_t time, int32_t every, int16_t free_oscs, int64_t stamp) {
     // I'm called when I get a sync response or a regular ping packet
     // I update a map of booted devices.
 
     //printf("[%d %d] Got a sync response client %d ipv4 %d time %lld\n",  ipv4_quartet, client_id, client , ipv4, time);
-    clocks[ipv4] = time;
-    int64_t my_sysclock = amy_sysclock();
-    ping_times[ipv4] = my_sysclock;
-
-    // Now I basically see what index I would be in the list of booted synths (clocks[i] > 0)
-    // And I set my client_id to that index
-    uint8_t last_alive = alive;
-    uint8_t my_new_client_id = 255;
-    alive = 0;
-    for(uint8_t i=0;i<255;i++) {
-        if(clocks[i] > 0) { 
-            if(my_sysclock < (ping_times[i] + (PING_TIME_MS * 2))) { // alive
-                //printf("[%d %d] Checking my time %lld against ipv4 %d's of %lld, client_id now %d ping_time[%d] = %lld\n", 
-                //    ipv4_quartet, client_id, my_sysclock, i, clocks[i], my_new_client_id, i, ping_times[i]);
-                alive++;
-            } else {
-                //printf("[ipv4 %d client %d] clock %d is dead, ping time was %lld time now is %lld.\n", ipv4_quartet, client_id, i, ping_times[i], my_sysclock);
-                clocks[i] = 0;
-                ping_times[i] = 0;
+    int64_t my_sysclock = alles_sysclock_ms();
+    uint16_t last_alive = me->alive;
+    member_expire(my_sysclock);
+    if(time > 0) {
+        // They said when their next ping is due. Give them a couple of lost pings at our own steady interval on top,
+        // a lone lost multicast packet shouldn't reshuffle everyone's client_id.
+        if(every < 0) every = PING_TIME_MS;
+        int64_t expire_time = my_sysclock + every + (int64_t)((float)ping_interval(me->alive, 0) * (1.0f + ALLES_PING_JITTER) * ALLES_PING_LOST);
+        member_update(member_key(addr, ipv4), ipv4, time, expire_time, free_oscs, stamp, my_sysclock);
+    }
+
+    // My client_id is my index in the list of booted synths, oldest first
+    int16_t my_new_client_id = me->members_older;
+    if(me->client_id != my_new_client_id || last_alive != me->alive) {
+        printf("[%d] my client_id is now %d. %d alive\n", me->ipv4_quartet, my_new_client_id, me->alive);
+        me->client_id = my_new_client_id;
+    }
+    if(last_alive != me->alive) ping_membership_changed(my_sysclock);
+}
+
+// Oscillators in our slice that aren't sounding or feeding another one. AMY's render owns synth[], but a stale count
+// only moves the next note to a different synth.
+int16_t alles_free_oscs() {
+    int16_t free_oscs = 0;
+    for(uint16_t i=me->osc_base;i<me->osc_base+me->osc_count;i++) {
+        uint8_t status = synth[i].status;
+        if(status != AUDIBLE && status != SCHEDULED && status != IS_MOD_SOURCE && status != IS_ALGO_SOURCE) free_oscs++;
+    }
+    return free_oscs;
+}
+
+// A g* note goes to whichever live synth scores highest on a hash of the message and its key, scaled by how many
+// oscillators it had free in its last ping, so synths with room win more notes and a full mesh shares them out
+// evenly. Nothing but the message and the members' own reports goes in, so every synth that agrees on who is
+// alive makes the same choice and exactly one plays it. If one has missed a member's ping, only the notes that
+// member would win can be played twice or not at all. The t in the message keeps repeated notes apart.
+static uint8_t voice_place(const char *message, uint16_t length) {
+    if(alles_offline) return 1;
+    uint64_t hash = 14695981039346656037ull;
+    for(uint16_t c=0;c<length;c++) hash = (hash ^ (uint8_t)message[c]) * 1099511628211ull;
+    uint16_t best = MEMBER_NONE;
+    uint64_t best_score = 0;
+    for(uint16_t s=0;s<ALLES_MEMBER_WHEEL_SLOTS;s++) {
+        for(uint16_t i=me->member_wheel[s];i!=MEMBER_NONE;i=me->members[i].next) {
+            struct member *m = &me->members[i];
+            uint64_t h = (hash ^ m->key) * 0x9E3779B97F4A7C15ull;
+            h ^= h >> 29;
+            uint64_t score = (h >> 32) * (uint64_t)((m->free_oscs > 0 ? m->free_oscs : 0) + 1);
+            if(best == MEMBER_NONE || score > best_score || (score == best_score && m->key < me->members[best].key)) {
+                best = i;
+                best_score = score;
             }
-            // If this is not me....
-            if(i != ipv4_quartet) {
-                // predicted time is what we think the alive node should be at by now
-                int64_t predicted_time = (my_sysclock - ping_times[i]) + clocks[i];
-                if(my_sysclock >= predicted_time) my_new_client_id--;
-            } else {
-                my_new_client_id--;
+        }
+    }
+    if(best == MEMBER_NONE) return 1; // no map yet, play it ourselves
+    return me->members[best].key == member_key(me->ipv4_address, me->ipv4_quartet);
+}
+
+// Where the block being played started, from alles_block_start. AMY's clock only moves a block (5.8 ms) at a
+// time, so between blocks we count on from here with a steady clock. The renderer writes it and the network
+// reads it, so block_seq is odd while it's being written, changes whenever it has been, and is 0 before the
+// first block. The 64 bit values are kept as 32 bit halves, which are atomic on the ESP32 too; a reader that
+// catches them half written sees block_seq move and doesn't use them.
+static atomic_uint_least32_t block_seq = 0;
+static atomic_uint_least32_t block_samples_lo, block_samples_hi; // AMY's clock at the start of the block
+static atomic_uint_least32_t block_start_lo, block_start_hi;     // ALLES_MONOTONIC_US() then
+
+static void block_store(atomic_uint_least32_t *lo, atomic_uint_least32_t *hi, int64_t v) {
+    atomic_store_explicit(lo, (uint32_t)v, memory_order_relaxed);
+    atomic_store_explicit(hi, (uint32_t)((uint64_t)v >> 32), memory_order_relaxed);
+}
+
+static int64_t block_load(atomic_uint_least32_t *lo, atomic_uint_least32_t *hi) {
+    uint64_t v = atomic_load_explicit(lo, memory_order_relaxed);
+    return (int64_t)(v | (uint64_t)atomic_load_explicit(hi, memory_order_relaxed) << 32);
+}
+
+#ifndef ESP_PLATFORM
+int64_t alles_monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+#endif
+
+// How far ahead of what's playing AMY renders, when something buffers its blocks on the way out (alles -a).
+// AMY's clock is what it has rendered; alles_sysclock_us is what's being heard, so syncing and scheduling
+// line up with synths that don't buffer, and events get this added back on the way into AMY.
+uint16_t alles_output_delay_ms = 0;
+
+// Rendering a message log (alles -r) we stand in for the whole mesh and never poll, so there's no map to keep:
+// every g address and every g* note plays here.
+uint8_t alles_offline = 0;
+
+// Called by whatever renders AMY's blocks as it starts each one, before amy_prepare_buffer. Renderers that
+// don't (AMY's own audio callback) leave alles_sysclock_us a block at a time.
+void alles_block_start() {
+    uint32_t seq = atomic_load_explicit(&block_seq, memory_order_relaxed);
+    atomic_store_explicit(&block_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    block_store(&block_start_lo, &block_start_hi, ALLES_MONOTONIC_US());
+    block_store(&block_samples_lo, &block_samples_hi, amy_global.total_samples);
+    atomic_store_explicit(&block_seq, seq + 2, memory_order_release);
+}
+
+// Our clock in us. AMY's clock is its sample count, so this is the clock amy_sysclock() reads and
+// the one AMY schedules events against, to the sample instead of to the ms, and then to the us within the
+// block from when it started. It never runs past the start of the next block, so it never goes backwards.
+int64_t alles_sysclock_us() {
+    int64_t samples = amy_global.total_samples;
+    uint32_t seq = atomic_load_explicit(&block_seq, memory_order_acquire);
+    int64_t start_samples = block_load(&block_samples_lo, &block_samples_hi);
+    int64_t start_us = block_load(&block_start_lo, &block_start_hi);
+    atomic_thread_fence(memory_order_acquire);
+    // Only if the block we know about is the one AMY is on, or has just finished rendering
+    if(seq == 0 || (seq & 1) || seq != atomic_load_explicit(&block_seq, memory_order_relaxed) ||
+            samples < start_samples || samples - start_samples > AMY_BLOCK_SIZE) {
+        return samples * 1000000 / AMY_SAMPLE_RATE - alles_output_delay_ms * 1000;
+    }
+    int64_t elapsed_us = ALLES_MONOTONIC_US() - start_us;
+    int64_t block_us = (int64_t)AMY_BLOCK_SIZE * 1000000 / AMY_SAMPLE_RATE - 1;
+    if(elapsed_us < 0) elapsed_us = 0;
+    if(elapsed_us > block_us) elapsed_us = block_us;
+    return start_samples * 1000000 / AMY_SAMPLE_RATE + elapsed_us - alles_output_delay_ms * 1000;
+}
+
+// The same in ms. Anything we put on the wire or time our pings by goes on this, not on amy_sysclock(), which
+// runs alles_output_delay_ms ahead of it when we render ahead.
+int64_t alles_sysclock_ms() {
+    return alles_sysclock_us() / 1000;
+}
+
+// Called by whatever renders AMY's blocks with how long one took
+void alles_render_block(uint32_t us) {
+    alles_load.blocks++;
+    alles_load.render_us += us;
+    if(us > alles_load.peak_us) alles_load.peak_us = us;
+}
+
+// Start with every oscillator costing the same whatever it plays, and ones not playing next to nothing
+void alles_partition_init(uint8_t parts) {
+    if(parts < 1) parts = 1;
+    if(parts > ALLES_RENDER_MAX_PARTS) parts = ALLES_RENDER_MAX_PARTS;
+    alles_partition.parts = parts;
+    for(uint8_t k=0;k<=parts;k++) alles_partition.bounds[k] = (uint32_t)AMY_OSCS * k / parts;
+    for(uint8_t k=0;k<parts;k++) {
+        alles_partition.start[k] = alles_partition.bounds[k];
+        alles_partition.end[k] = alles_partition.bounds[k+1];
+    }
+    alles_partition.active_count = 0;
+    for(uint8_t j=0;j<ALLES_COST_KINDS-1;j++) alles_partition.cost_us[j] = 1.0f;
+    alles_partition.cost_us[ALLES_COST_KINDS-1] = 0.05f;
+    alles_partition.base_us = 0;
+    memset(alles_partition.kinds, ALLES_COST_KINDS-1, sizeof(alles_partition.kinds));
+}
+
+// List what's playing and cut this block's parts. Call after amy_prepare_buffer, which is when notes start
+// and stop; a voice whose envelope finishes during a render drops off the list the block after.
+void alles_partition_plan() {
+    struct alles_partition *p = &alles_partition;
+    if(p->parts < 1) return;
+    float total = 0;
+    p->active_count = 0;
+    for(uint16_t i=0;i<AMY_OSCS;i++) {
+        // AMY only renders audible oscillators itself; mod and algo sources are rendered by whoever uses them
+        uint8_t kind = ALLES_COST_KINDS-1;
+        if(synth[i].status == AUDIBLE) {
+            kind = synth[i].wave < ALLES_COST_KINDS-1 ? synth[i].wave : ALLES_COST_KINDS-2;
+            p->active[p->active_count++] = i;
+        }
+        p->kinds[i] = kind;
+        total += p->cost_us[kind];
+    }
+    if(p->parts > 1) {
+        // Cut where the running cost passes each share, on whichever side of the oscillator is closer
+        float sum = 0;
+        uint8_t k = 1;
+        for(uint16_t i=0;i<AMY_OSCS && k<p->parts;i++) {
+            float c = p->cost_us[p->kinds[i]];
+            while(k < p->parts && sum + c / 2 >= total * k / p->parts) p->bounds[k++] = i;
+            sum += c;
+        }
+        while(k < p->parts) p->bounds[k++] = AMY_OSCS;
+    }
+    // Trim each share to its audible oscillators. A part with none still gets called, with nothing to render,
+    // so AMY clears its buffer.
+    uint16_t a = 0;
+    for(uint8_t k=0;k<p->parts;k++) {
+        while(a < p->active_count && p->active[a] < p->bounds[k]) a++;
+        p->start[k] = p->end[k] = p->bounds[k];
+        if(a < p->active_count && p->active[a] < p->bounds[k+1]) {
+            p->start[k] = p->active[a];
+            while(a < p->active_count && p->active[a] < p->bounds[k+1]) a++;
+            p->end[k] = p->active[a-1] + 1;
+        }
+    }
+}
+
+// How long each part of the block just rendered took: learn from it, and count how uneven it was
+void alles_partition_measured(const uint32_t *us) {
+    struct alles_partition *p = &alles_partition;
+    if(p->parts < 2) return;
+    uint32_t slowest = 0, total = 0;
+    for(uint8_t k=0;k<p->parts;k++) {
+        // Normalised LMS: nudge the costs of the kinds in this part by their share of the prediction error
+        uint16_t counts[ALLES_COST_KINDS] = {0};
+        for(uint16_t i=p->start[k];i<p->end[k];i++) counts[p->kinds[i]]++;
+        float predicted = p->base_us, norm = 1;
+        for(uint8_t j=0;j<ALLES_COST_KINDS;j++) {
+            predicted += p->cost_us[j] * counts[j];
+            norm += (float)counts[j] * counts[j];
+        }
+        float step = ALLES_COST_RATE * ((float)us[k] - predicted) / norm;
+        for(uint8_t j=0;j<ALLES_COST_KINDS;j++) {
+            if(!counts[j]) continue;
+            p->cost_us[j] += step * counts[j];
+            if(p->cost_us[j] < 0.01f) p->cost_us[j] = 0.01f;
+        }
+        p->base_us += step;
+        if(p->base_us < 0) p->base_us = 0;
+        if(us[k] > slowest) slowest = us[k];
+        total += us[k];
+    }
+    if(total == 0) return;
+    float imbalance = ((float)slowest * p->parts / total - 1.0f) * 100.0f;
+    alles_load.split_blocks++;
+    alles_load.imbalance_sum += imbalance;
+    if(imbalance > alles_load.imbalance_peak) alles_load.imbalance_peak = imbalance;
+}
+
+// Load fields for a reply or ping: c and k are the average and longest block as a percent of the block's
+// playback time (left out if nothing here times the render), b how much longer the slowest part of a split
+// block took than the average part, in % (left out if blocks aren't split), s the deepest the event queue got,
+// n late and d dropped events since boot. Starts a new window.
+// Virtual synths share the process's one render and queue, so only the first reports them and starts the
+// window; otherwise every other synth's ping would cut the first's window short.
+static int alles_load_fields(char *out, size_t size) {
+    int len = 0;
+    if(me != alles_nodes[0]) return snprintf(out, size, "n%" PRIu32 "d%" PRIu32, me->latency_stats.late, alles_load.dropped);
+    if(alles_load.blocks) {
+        float block_us = AMY_BLOCK_SIZE * 1000000.0f / AMY_SAMPLE_RATE;
+        len = snprintf(out, size, "c%.1fk%.1f", alles_load.render_us / (float)alles_load.blocks / block_us * 100.0f,
+            alles_load.peak_us / block_us * 100.0f);
+    }
+    if(alles_load.split_blocks) len += snprintf(out + len, size - len, "b%.1f", alles_load.imbalance_sum / alles_load.split_blocks);
+    len += snprintf(out + len, size - len, "s%dn%" PRIu32 "d%" PRIu32, alles_load.queue_peak, me->latency_stats.late, alles_load.dropped);
+    alles_load.blocks = 0;
+    alles_load.render_us = 0;
+    alles_load.peak_us = 0;
+    alles_load.split_blocks = 0;
+    alles_load.imbalance_sum = 0;
+    alles_load.imbalance_peak = 0;
+    alles_load.queue_peak = amy_global.event_qsize;
+    return len;
+}
+
+void latency_stats_init(struct latency_stats *l) {
+    for(uint16_t i=0;i<ALLES_LATENCY_BUCKETS;i++) l->buckets[i] = 0;
+    l->count = 0;
+    l->added = 0;
+    l->late = 0;
+}
+
+// Count one message that arrived us later than the fastest one would have
+void latency_stats_add(struct latency_stats *l, int64_t us) {
+    int64_t b = us < 0 ? 0 : us / (ALLES_LATENCY_BUCKET_MS * 1000);
+    if(b >= ALLES_LATENCY_BUCKETS) b = ALLES_LATENCY_BUCKETS - 1;
+    l->buckets[b]++;
+    l->added++;
+    if(++l->count >= ALLES_LATENCY_WINDOW) {
+        l->count = 0;
+        for(uint16_t i=0;i<ALLES_LATENCY_BUCKETS;i++) {
+            l->buckets[i] /= 2;
+            l->count += l->buckets[i];
+        }
+    }
+}
+
+// The delay in ms that percentile percent of messages came in under, -1 if we haven't seen enough yet
+int32_t latency_stats_percentile(struct latency_stats *l, float percentile) {
+    if(l->count < ALLES_LATENCY_MIN_SAMPLES) return -1;
+    uint32_t allowed = (uint32_t)((float)l->count * (100.0f - percentile) / 100.0f);
+    uint32_t above = 0;
+    for(int16_t b=ALLES_LATENCY_BUCKETS-1;b>=0;b--) {
+        above += l->buckets[b];
+        if(above > allowed) return (b + 1) * ALLES_LATENCY_BUCKET_MS;
+    }
+    return 0;
+}
+
+// What we'd like amy_global.latency_ms to be. Every reply carries it, so only walk the histogram again
+// once there are a few more samples in it.
+int32_t latency_recommend() {
+    if(me->latency_recommended < 0 || me->latency_stats.added - me->latency_recommended_at >= ALLES_LATENCY_MIN_SAMPLES) {
+        int32_t ms = latency_stats_percentile(&me->latency_stats, me->latency_target);
+        me->latency_recommended = ms < 0 ? -1 : ms + ALLES_LATENCY_MARGIN_MS;
+        me->latency_recommended_at = me->latency_stats.added;
+    }
+    return me->latency_recommended;
+}
+
+// Clock offset estimation. Each sync request gives us the host's send time t1 and our receive time t2.
+// t1 - t2 is the true offset minus that packet's one-way delay, so the largest sample in the window is the
+// one that had the least delay (the minimum round trip, in NTP terms) and is the best offset we have.
+// The one-way delay that's left over is the same for every node on the network, so it just becomes part of
+// the latency. We move the sender's offset towards that estimate gradually rather than jumping.
+// Crystals differ by tens of ppm, so we also track how fast the offset moves (a simple FLL over the best
+// offsets, at least ALLES_FREQ_INTERVAL_MS apart) and carry the offset forward at that rate between syncs.
+void clock_estimator_init(struct clock_estimator *c) {
+    c->count = 0;
+    c->next = 0;
+    c->target_us = 0;
+    c->target_time = 0;
+    c->delta_us = 0;
+    c->last_slew = 0;
+    c->ppm = 0;
+    c->freq_locked = 0;
+    c->ref_offset_us = 0;
+    c->ref_time = 0;
+    c->measuring = 0;
+    c->measure_offset_us = 0;
+    c->measure_time = 0;
+    c->measure_base_ppm = 0;
+}
+
+// Where the offset will have drifted to by now
+static int64_t clock_estimator_target_us(struct clock_estimator *c, int64_t now_us) {
+    return c->target_us + (int64_t)((double)c->ppm * (double)(now_us - c->target_time) / 1e6);
+}
+
+void clock_estimator_sample(struct clock_estimator *c, int64_t remote_us, int64_t local_us) {
+    c->samples[c->next] = remote_us - local_us;
+    c->sample_times[c->next] = local_us;
+    c->next = (c->next + 1) % ALLES_SYNC_SAMPLES;
+    if(c->count < ALLES_SYNC_SAMPLES) c->count++;
+    // Bring older samples forward by the drift since they were taken before comparing them
+    int64_t best_us = 0;
+    for(uint8_t i=0;i<c->count;i++) {
+        int64_t us = c->samples[i] + (int64_t)((double)c->ppm * (double)(local_us - c->sample_times[i]) / 1e6);
+        if(i == 0 || us > best_us) best_us = us;
+    }
+    c->target_us = best_us;
+    c->target_time = local_us;
+    int64_t raw_us = remote_us - local_us;
+    if(c->count == 1) {
+        // First sample, nothing to slew from
+        c->delta_us = c->target_us;
+        c->last_slew = local_us;
+        c->ref_offset_us = raw_us;
+        c->ref_time = local_us;
+        c->measuring = 0;
+    } else if(!c->measuring && local_us - c->ref_time < (int64_t)ALLES_FREQ_WINDOW_MS * 1000) {
+        // Still near the start of the span, keep the least delayed sample
+        if(raw_us > c->ref_offset_us) c->ref_offset_us = raw_us;
+    } else if(local_us - c->ref_time >= (int64_t)ALLES_FREQ_INTERVAL_MS * 1000) {
+        // Compare the least delayed sample near each end. One sample against one would put the whole
+        // difference in their network delays into the rate.
+        if(!c->measuring) {
+            c->measuring = 1;
+            c->measure_offset_us = raw_us;
+            c->measure_time = local_us;
+            c->measure_base_ppm = c->ppm;
+        } else if(local_us - c->measure_time < (int64_t)ALLES_FREQ_WINDOW_MS * 1000) {
+            if(raw_us > c->measure_offset_us) c->measure_offset_us = raw_us;
+        } else {
+            // That window has closed. Until we have measured over a long span, keep the same start so each
+            // measurement is better than the last. After that each span starts where the last one ended, and
+            // the filter follows the crystal as it warms and cools.
+            if(c->freq_locked || c->measure_time - c->ref_time >= (int64_t)ALLES_FREQ_SPAN_MS * 1000) {
+                c->ref_offset_us = c->measure_offset_us;
+                c->ref_time = c->measure_time;
+                c->freq_locked = 1;
             }
+            c->measuring = 0;
+            return;
+        }
+        float measured = (float)((double)(c->measure_offset_us - c->ref_offset_us) * 1e6 / (double)(c->measure_time - c->ref_time));
+        if(!c->freq_locked) {
+            c->ppm = measured;
         } else {
-            // if clocks[] is 0, no need to check
-            my_new_client_id--;
+            c->ppm = c->measure_base_ppm + (measured - c->measure_base_ppm) / ALLES_FREQ_GAIN;
         }
     }
-    if(client_id != my_new_client_id || last_alive != alive) {
-        printf("[%d] my client_id is now %d. %d alive\n", ipv4_quartet, my_new_client_id, alive);
-        client_id = my_new_client_id;
+}
+
+// Offset to use at local time now, in us. Slews at ALLES_CLOCK_SLEW_US_PER_MS, steps if way off.
+int64_t clock_estimator_delta(struct clock_estimator *c, int64_t now_us) {
+    int64_t error_us = clock_estimator_target_us(c, now_us) - c->delta_us;
+    if(error_us > (int64_t)ALLES_MAX_DRIFT_MS * 1000 || error_us < -(int64_t)ALLES_MAX_DRIFT_MS * 1000) {
+        c->delta_us += error_us;
+        c->last_slew = now_us;
+        return c->delta_us;
+    }
+    // Only count time we actually slewed over, so calls less than a step apart still add up
+    int64_t max_step = (now_us - c->last_slew) * ALLES_CLOCK_SLEW_US_PER_MS / 1000;
+    if(max_step > 0) {
+        if(error_us > max_step) error_us = max_step;
+        if(error_us < -max_step) error_us = -max_step;
+        c->delta_us += error_us;
+        c->last_slew = now_us;
     }
+    return c->delta_us;
 }
 
-void handle_sync(int64_t time, int8_t index) {
-    // I am called when I get an s message, which comes along with host time and index
-    int64_t sysclock = amy_sysclock();
-    char message[100];
+// The address part of a member key, back in network order
+static uint32_t member_addr(uint64_t key) {
+    uint32_t addr;
+    uint8_t *a = (uint8_t *)&addr;
+    a[0] = key >> 32; a[1] = key >> 24; a[2] = key >> 16; a[3] = key >> 8;
+    return addr;
+}
+
+// The table entry for whoever sent this, making one if they're new. When the table is full the sender we
+// heard from longest ago loses its slot.
+static struct sender *sender_find(uint32_t addr, int64_t now) {
+    struct sender *slot = NULL;
+    for(uint8_t i=0;i<ALLES_SENDERS;i++) {
+        struct sender *s = &me->senders[i];
+        if(s->used && s->addr == addr) {
+            s->last_seen = now;
+            return s;
+        }
+        if(!s->used || now - s->last_seen > ALLES_SENDER_EXPIRE_MS) {
+            if(slot == NULL || slot->used) slot = s;
+        } else if(slot == NULL || (slot->used && s->last_seen < slot->last_seen)) {
+            slot = s;
+        }
+    }
+    slot->used = 1;
+    slot->addr = addr;
+    slot->last_seen = now;
+    slot->computed_delta = 0;
+    slot->computed_delta_set = 0;
+    clock_estimator_init(&slot->clock);
+    slot->events = 0;
+    slot->late = 0;
+    slot->resets = 0;
+    return slot;
+}
+
+void alles_print_senders() {
+    int64_t now = alles_sysclock_ms();
+    for(uint8_t i=0;i<ALLES_SENDERS;i++) {
+        struct sender *s = &me->senders[i];
+        if(!s->used) continue;
+        const uint8_t *a = (const uint8_t *)&s->addr;
+        if(s->clock.count) {
+            printf("sender %d.%d.%d.%d: seen %" PRIi64 " ms ago, synced, offset %.3f ms, %.2f ppm, %" PRIu32 " events, %" PRIu32 " late\n",
+                a[0], a[1], a[2], a[3], now - s->last_seen, s->clock.delta_us / 1000.0f, s->clock.ppm, s->events, s->late);
+        } else {
+            printf("sender %d.%d.%d.%d: seen %" PRIi64 " ms ago, offset %" PRIi32 " ms from events (%" PRIu32 " resets), %" PRIu32 " events, %" PRIu32 " late\n",
+                a[0], a[1], a[2], a[3], now - s->last_seen, s->computed_delta, s->resets, s->events, s->late);
+        }
+    }
+}
+
+// We keep the mesh clock if we rank first and know where we are on it
+static uint8_t alles_is_master() {
+    return me->client_id == 0 && me->boot_stamp != ALLES_STAMP_NONE;
+}
+
+// B and our boot stamp for a reply, ping or beacon, once we have one
+static int alles_stamp_field(char *out, size_t size) {
+    out[0] = 0;
+    if(me->boot_stamp == ALLES_STAMP_NONE) return 0;
+    return snprintf(out, size, "B%lld", (long long)me->boot_stamp);
+}
+
+// It's ok that our reply and ping fields are AMY letters too. We never run AMY's parser on a _ message, and older
+// alles firmware, which does, throws the event away once it sees the _, as it always did with r and y. So a letter
+// only matters there if AMY acts on it while parsing, instead of just filling in the event it hands back; that's
+// debug (D) and reset (S), which we don't send. The ones we added since (p e h l o c k b s n d B x q) at most
+// fill in note, effect or breakpoint fields of that discarded event. Sync requests (w x m L P) are the same: old
+// firmware answers them and never queues their event.
+static void sync_reply_send(int8_t index, int64_t received_us, uint8_t relay, float ppm) {
+    int64_t sysclock_us = alles_sysclock_us();
+    char message[ALLES_REPLY_LEN];
+    char load[ALLES_LOAD_FIELDS_LEN];
+    char stamp[ALLES_STAMP_FIELD_LEN];
+    // Only hand it to the master if there is one, and it isn't us
+    relay = relay && !alles_is_master() && me->mesh_master != MEMBER_NONE;
     // Before I send, i want to update the map locally
-    update_map(client_id, ipv4_quartet, sysclock);
-    // Send back sync message with my time and received sync index and my client id & battery status (if any)
-    sprintf(message, "_U%lldi%dg%dr%dy%dZ", sysclock, index, client_id, ipv4_quartet, battery_mask);
-    mcast_send(message, strlen(message));
-    // Update computed delta (i could average these out, but I don't think that'll help too much)
-    //int64_t old_cd = computed_delta;
-    //computed_delta = time - sysclock;
-    //computed_delta_set = 1;
-    //if(old_cd != computed_delta) printf("Changed computed_delta from %lld to %lld on sync\n", old_cd, computed_delta);
+    int16_t free_oscs = alles_free_oscs();
+    update_map(me->client_id, me->ipv4_address, me->ipv4_quartet, sysclock_us / 1000, -1, free_oscs, me->boot_stamp);
+    // Send back sync message with my time as I send it (to the us) and how long I held it, the received sync index,
+    // my client id & battery status (if any), how many oscillators I have free and when I booted on the mesh clock
+    alles_load_fields(load, sizeof(load));
+    alles_stamp_field(stamp, sizeof(stamp));
+    snprintf(message, sizeof(message), "_U%lld.%03di%dg%dr%dy%dp%.2fe%dh%lldl%do%d%s%s%sZ", (long long)(sysclock_us / 1000), (int)(sysclock_us % 1000), index, me->client_id, me->ipv4_quartet, battery_mask, ppm,
+        ping_every(sysclock_us / 1000), (long long)(sysclock_us - received_us), latency_recommend(), free_oscs, load, stamp, relay ? "x1" : "");
+    if(relay) {
+        udp_send(member_addr(me->members[me->mesh_master].key), message, strlen(message));
+    } else {
+        mcast_send(message, strlen(message));
+    }
+}
+
+void handle_sync(struct alles_message *m) {
+    // I am called when I get an s message, which comes along with host time and index
+    int64_t received_us = m->received_us;
+    float ppm = me->sync_ppm;
+    if(!m->sync_monitor) {
+        // Feed the host's send time and our receive time to their offset estimator
+        int64_t time_us = m->sync * 1000 + m->sync_us;
+        struct sender *from = sender_find(m->addr, m->sysclock);
+        clock_estimator_sample(&from->clock, time_us, received_us);
+        ppm = me->sync_ppm = from->clock.ppm;
+        // How much later than the fastest recent request this one took to get here
+        latency_stats_add(&me->latency_stats, from->clock.target_us - (time_us - received_us));
+    }
+    if(m->sync_relay && alles_is_master()) {
+        // Everyone will be handing us their replies, send them on once the window has closed
+        int64_t flush = received_us / 1000 + m->sync_window + ALLES_SYNC_RELAY_GRACE_MS;
+        if(me->sync_relay_flush < flush) me->sync_relay_flush = flush;
+    }
+    if(m->sync_window > 0) {
+        // Hold the reply until a random point in the window
+        for(uint8_t i=0;i<ALLES_SYNC_PENDING;i++) {
+            struct sync_reply *r = &me->sync_pending[i];
+            if(r->send_time) continue;
+            r->send_time = received_us / 1000 + 1 + ping_random() % m->sync_window;
+            r->received_us = received_us;
+            r->index = m->sync_index;
+            r->relay = m->sync_relay;
+            r->ppm = ppm;
+            return;
+        }
+    }
+    sync_reply_send(m->sync_index, received_us, m->sync_relay, ppm);
+}
+
+// Send the replies we gathered on to everyone as one packet
+static void sync_relay_send() {
+    char packet[MAX_RECEIVE_LEN];
+    uint16_t len = 0;
+    int64_t sysclock_us = alles_sysclock_us();
+    // q is how long we held each one, on top of the h they held it for
+    for(uint8_t i=0;i<me->sync_relay_count;i++) {
+        if(len + sizeof(me->sync_relay[i].text) + 24 > sizeof(packet)) {
+            mcast_send(packet, len);
+            len = 0;
+        }
+        len += snprintf(packet + len, sizeof(packet) - len, "%sq%lldZ", me->sync_relay[i].text, (long long)(sysclock_us - me->sync_relay[i].received_us));
+    }
+    if(len) mcast_send(packet, len);
+    me->sync_relay_count = 0;
 }
 
-// It's ok that r & y are used by AMY, this is only to return values
+// A reply someone handed us to pass on, because we are the time master
+static void sync_relay_add(struct alles_message *m) {
+    if(m->length >= sizeof(me->sync_relay[0].text)) return;
+    if(me->sync_relay_count == 0 && me->sync_relay_flush < m->sysclock) me->sync_relay_flush = m->sysclock + ALLES_SYNC_RELAY_GRACE_MS;
+    memcpy(me->sync_relay[me->sync_relay_count].text, m->message, m->length);
+    me->sync_relay[me->sync_relay_count].text[m->length] = 0;
+    me->sync_relay[me->sync_relay_count].received_us = m->received_us;
+    if(++me->sync_relay_count == ALLES_SYNC_RELAY_MAX) sync_relay_send();
+}
 void ping(int64_t sysclock) {
-    char message[100];
+    char message[ALLES_PING_LEN];
+    char load[ALLES_LOAD_FIELDS_LEN];
+    char stamp[ALLES_STAMP_FIELD_LEN];
+    // Pick our next ping first, so we can tell everyone when to expect it
+    me->next_ping_time = sysclock + ping_jitter(ping_interval(me->alive, sysclock < me->ping_fast_until), ping_random());
     //printf("[%d %d] pinging with %lld\n", ipv4_quartet, client_id, sysclock);
-    sprintf(message, "_U%lldi-1g%dr%dy%dZ", sysclock, client_id, ipv4_quartet, battery_mask);
-    update_map(client_id, ipv4_quartet, sysclock);
+    int16_t free_oscs = alles_free_oscs();
+    alles_load_fields(load, sizeof(load));
+    alles_stamp_field(stamp, sizeof(stamp));
+    snprintf(message, sizeof(message), "_U%lldi-1g%dr%dy%dp%.2fe%dl%do%d%s%sZ", (long long)sysclock, me->client_id, me->ipv4_quartet, battery_mask, me->sync_ppm, ping_every(sysclock),
+        latency_recommend(), free_oscs, load, stamp);
+    update_map(me->client_id, me->ipv4_address, me->ipv4_quartet, sysclock, -1, free_oscs, me->boot_stamp);
     mcast_send(message, strlen(message));
-    last_ping_time = sysclock;
 }
 
+// The time master's beacon. It's a ping with a sync index of -2, so it also keeps the master in everyone's map.
+// Its time is the mesh clock: ours plus when we booted on it, which carries on across a change of master.
+void beacon(int64_t sysclock) {
+    char message[ALLES_BEACON_LEN];
+    char stamp[ALLES_STAMP_FIELD_LEN];
+    int64_t mesh_us = alles_sysclock_us() + me->boot_stamp * 1000;
+    int16_t free_oscs = alles_free_oscs();
+    alles_stamp_field(stamp, sizeof(stamp));
+    snprintf(message, sizeof(message), "_U%lld.%03di%dg%dr%dy%dp%.2fe%do%d%sZ", (long long)(mesh_us / 1000), (int)(mesh_us % 1000), ALLES_BEACON_INDEX, me->client_id, me->ipv4_quartet, battery_mask, me->sync_ppm,
+        ping_every(sysclock), free_oscs, stamp);
+    update_map(me->client_id, me->ipv4_address, me->ipv4_quartet, sysclock, -1, free_oscs, me->boot_stamp);
+    mcast_send(message, strlen(message));
+    me->last_beacon_time = sysclock;
+}
 
-void alles_parse_message(char *message, uint16_t length) {
-    uint8_t mode = 0;
-    int16_t client = -1;
-    int64_t sync = -1;
-    int8_t sync_index = -1;
-    uint8_t ipv4 = 0;
-    uint16_t start = 0;
-    uint16_t c = 0;
+// Called by the listener every time round its loop: pings when they're due, and beacons if we're the time master
+static void alles_node_poll() {
+    int64_t sysclock = alles_sysclock_ms();
+    if(me->next_ping_time == 0) {
+        // We just booted, which is a membership change of its own
+        me->next_ping_time = sysclock + ping_random() % ALLES_PING_FIRST_MS;
+        me->ping_fast_until = sysclock + ALLES_PING_SETTLE_MS;
+    }
+    alles_boot_stamp(sysclock);
+    if(sysclock >= me->next_ping_time) ping(sysclock);
+    if(alles_is_master() && sysclock > (me->last_beacon_time+ALLES_BEACON_MS)) beacon(sysclock);
+    for(uint8_t i=0;i<ALLES_SYNC_PENDING;i++) {
+        struct sync_reply *r = &me->sync_pending[i];
+        if(r->send_time && sysclock >= r->send_time) {
+            r->send_time = 0;
+            sync_reply_send(r->index, r->received_us, r->relay, r->ppm);
+        }
+    }
+    if(me->sync_relay_count && sysclock >= me->sync_relay_flush) sync_relay_send();
+}
+
+// How long the listener can wait for packets before alles_poll has something to do, at most a second
+static int64_t alles_node_next(int64_t sysclock) {
+    int64_t next = sysclock + 1000;
+    if(me->next_ping_time && me->next_ping_time < next) next = me->next_ping_time;
+    if(alles_is_master() && me->last_beacon_time + ALLES_BEACON_MS < next) next = me->last_beacon_time + ALLES_BEACON_MS;
+    for(uint8_t i=0;i<ALLES_SYNC_PENDING;i++) {
+        if(me->sync_pending[i].send_time && me->sync_pending[i].send_time < next) next = me->sync_pending[i].send_time;
+    }
+    if(me->sync_relay_count && me->sync_relay_flush < next) next = me->sync_relay_flush;
+    return next;
+}
+
+// When alles_poll next has something to do, in ms on alles_sysclock_ms, modulo 2^32 so it's atomic on the ESP32
+// too. Whoever polls or applies sync traffic updates it under the apply lock; the listener reads it without,
+// so it only takes the lock when something is due. 0 to start with, so the first poll comes right away.
+static atomic_uint_least32_t poll_next_ms = 0;
+
+static void poll_next_update() {
+    int64_t sysclock = alles_sysclock_ms();
+    int64_t next = sysclock + 1000;
+    struct alles_node *was = me;
+    for(uint16_t i=0;i<alles_node_count;i++) {
+        me = alles_nodes[i];
+        int64_t n = alles_node_next(sysclock);
+        if(n < next) next = n;
+    }
+    me = was;
+    atomic_store_explicit(&poll_next_ms, (uint32_t)next, memory_order_relaxed);
+}
+
+// How long the listener can wait before it needs to call alles_poll, 0 if it's due now. Safe without the lock.
+int32_t alles_poll_wait_ms() {
+    int32_t wait = (int32_t)(atomic_load_explicit(&poll_next_ms, memory_order_relaxed) - (uint32_t)alles_sysclock_ms());
+    if(wait < 0) return 0;
+    return wait > 1000 ? 1000 : wait;
+}
+
+void alles_poll() {
+    struct alles_node *was = me;
+    for(uint16_t i=0;i<alles_node_count;i++) {
+        me = alles_nodes[i];
+        alles_node_poll();
+    }
+    me = was;
+    poll_next_update();
+}
+
+// A beacon from whoever thinks they are client 0. If two nodes claim it for a moment (say, as two meshes
+// merge), follow the one that booted first; it is the one everybody will agree on once the pings settle.
+static void handle_beacon(struct alles_message *m) {
+    uint64_t key = member_key(m->addr, m->ipv4);
+    if(key == member_key(me->ipv4_address, me->ipv4_quartet)) return;
+    me->beacon_heard = 1;
+    if(m->client != 0) return;
+    uint16_t i = member_find(key);
+    if(i == MEMBER_NONE) return;
+    if(me->mesh_master != i) {
+        if(me->mesh_master != MEMBER_NONE && member_is_older_than(me->mesh_master, i)) return;
+        printf("[%d] following time master %d\n", me->ipv4_quartet, m->ipv4);
+        me->mesh_master = i;
+        clock_estimator_init(&me->mesh_clock);
+    }
+    clock_estimator_sample(&me->mesh_clock, m->sync * 1000 + m->sync_us, m->received_us);
+}
+
+
+// Numeric parsing for the wire protocol. Fields are not NUL terminated where we read them, so these
+// take a length and stop at the first character that isn't part of the number, like atoi/atof would.
+// The protocol only ever sends [-+]digits[.digits], so no locale, whitespace or exponent handling.
+// Numbers too big for the type stick at its largest value rather than wrapping.
+#define ALLES_ATOL_MAX 0x7FFFFFFFFFFFFFFFLL
+
+// The digits at s[*i], advancing *i past all of them
+static int64_t alles_digits(const char *s, uint16_t len, uint16_t *i) {
+    int64_t v = 0;
+    while(*i < len && (uint8_t)(s[*i] - '0') < 10) {
+        int64_t d = s[*i] - '0';
+        v = (v > (ALLES_ATOL_MAX - d) / 10) ? ALLES_ATOL_MAX : v * 10 + d;
+        (*i)++;
+    }
+    return v;
+}
+
+int64_t alles_atol(const char *s, uint16_t len) {
+    uint16_t i = 0;
+    uint8_t neg = 0;
+    if(i < len && (s[i] == '-' || s[i] == '+')) { neg = (s[i] == '-'); i++; }
+    int64_t v = alles_digits(s, len, &i);
+    return neg ? -v : v;
+}
 
-    uint32_t sysclock = amy_sysclock();
+int32_t alles_atoi(const char *s, uint16_t len) {
+    int64_t v = alles_atol(s, len);
+    if(v > 0x7FFFFFFF) return 0x7FFFFFFF;
+    if(v < -0x7FFFFFFF) return -0x7FFFFFFF;
+    return (int32_t)v;
+}
 
+float alles_atof(const char *s, uint16_t len) {
+    uint16_t i = 0;
+    uint8_t neg = 0;
+    uint32_t frac = 0;
+    uint32_t scale = 1;
+    if(i < len && (s[i] == '-' || s[i] == '+')) { neg = (s[i] == '-'); i++; }
+    int64_t whole = alles_digits(s, len, &i);
+    if(i < len && s[i] == '.') {
+        i++;
+        // 9 digits of fraction is already past what a float can hold
+        while(i < len && (uint8_t)(s[i] - '0') < 10 && scale < 1000000000) {
+            frac = frac * 10 + (s[i] - '0');
+            scale = scale * 10;
+            i++;
+        }
+    }
+    float v = (float)whole + (float)frac / (float)scale;
+    return neg ? -v : v;
+}
 
-    // Parse the AMY stuff out of the message first
-    struct event e = amy_parse_message(message);
-    uint8_t sync_response = 0;
+// The fraction of a ms after a time field, in us: 12.5 is 500. Digits past the third are dropped.
+uint16_t alles_frac_us(const char *s, uint16_t len) {
+    uint16_t i = 0;
+    while(i < len && s[i] != '.') i++;
+    i++;
+    uint16_t us = 0;
+    for(uint16_t scale=100;scale>0;scale/=10) {
+        if(i < len && (uint8_t)(s[i] - '0') < 10) us += (s[i++] - '0') * scale;
+    }
+    return us;
+}
 
+// Parsed-message cache. Live-coded loops send the same event string over and over with only t changing,
+// so we keep the parsed event for a message keyed on its bytes with the t digits left out. A hit copies the
+// event and patches its time instead of running amy_parse_message again. Direct mapped, fixed size.
+// Each decoder owns its cache, alles_parse_message uses this one.
+struct parse_cache parse_cache;
 
+// Only plain per-oscillator event fields get cached. Anything else (resets, effects config, debug,
+// volume, patch storage...) may be acted on by AMY while parsing, so those messages are parsed afresh every
+// time, and only when they're applied.
+static uint8_t parse_cache_field_ok(uint8_t b) {
+    return strchr("tvwnlfaAbBcdFGIopOPQRLTWmg", b) != NULL;
+}
 
-    // Then pull out any alles-specific modes in this message 
+void parse_cache_init(struct parse_cache *cache) {
+    for(uint16_t i=0;i<ALLES_PARSE_CACHE_ENTRIES;i++) cache->entries[i].key_len = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+}
+
+// Is synth n in the g field? A single id wraps around the number of synths alive and above 255 it's a
+// group, see the README. A list of ids and ranges, like g2,5,9-17, names client_ids exactly, up to 255.
+// Decoding runs on the parse workers, which read client_id and alive without the apply lock; a message that
+// races a change of membership goes to the synths that were there when it arrived, like any other.
+// They never touch me, which belongs to whoever holds the lock.
+static uint8_t alles_targets(struct alles_node *n, const char *s, uint16_t len) {
+    if(alles_offline) return 1;
+    uint8_t list = 0;
+    for(uint16_t i=1;i<len;i++) if(s[i] == ',' || s[i] == '-') list = 1;
+    if(!list) {
+        int16_t client = alles_atoi(s, len);
+        if(client < 0) return 1;
+        if(client <= 255) {
+            // If they gave an individual client ID check that it exists
+            if(n->alive>0 && client >= n->alive) client = client % n->alive; // alive may get to 0 in a bad situation
+            return client == n->client_id;
+        }
+        // It's a group message, see if i'm in the group
+        return n->client_id % (client-255) == 0;
+    }
+    uint16_t i = 0;
+    while(i < len) {
+        int16_t lo = 0;
+        while(i < len && s[i] >= '0' && s[i] <= '9') if((lo = lo * 10 + (s[i++] - '0')) > 256) lo = 256;
+        int16_t hi = lo;
+        if(i < len && s[i] == '-') {
+            hi = 0;
+            i++;
+            if(i == len || s[i] < '0' || s[i] > '9') hi = 255; // open ended, 128- is everyone from 128 up
+            while(i < len && s[i] >= '0' && s[i] <= '9') if((hi = hi * 10 + (s[i++] - '0')) > 256) hi = 256;
+        }
+        if(n->client_id >= lo && n->client_id <= hi) return 1;
+        while(i < len && (s[i] < '0' || s[i] > '9')) i++;
+    }
+    return 0;
+}
+
+// Turn a message into an alles_message. This touches no shared state besides the cache it is given,
+// so several threads can decode at once as long as each has its own cache. Only plain note and parameter
+// messages go through AMY's parser here; anything AMY might act on while parsing (see parse_cache_field_ok)
+// is left with parse_later set for alles_apply_message to parse, in order and under the apply lock.
+void alles_decode_message(char *message, uint16_t length, int64_t received_us, uint32_t addr, struct parse_cache *cache, struct alles_message *m) {
+    uint8_t mode = 0;
+    uint16_t start = 0;
+    uint16_t c = 0;
+    m->client = -1;
+    m->sync = -1;
+    m->sync_us = 0;
+    m->sync_index = -1;
+    m->sync_window = 0;
+    m->sync_relay = 0;
+    m->relayed = 0;
+    m->sync_monitor = 0;
+    m->latency = -1;
+    m->latency_target = 0;
+    m->ipv4 = 0;
+    m->addr = addr;
+    m->time = -1;
+    m->time_us = 0;
+    m->sysclock = received_us / 1000;
+    m->received_us = received_us;
+    m->length = length;
+    m->message = message;
+    m->sync_response = (length > 0 && message[0] == '_');
+    m->every = -1;
+    m->mesh_time = (length > 0 && message[0] == '@');
+    m->for_me = 1;
+    m->parse_later = 0;
+    m->voice = 0;
+    m->target_len = 0;
+    m->free_oscs = -1;
+    m->boot_stamp = ALLES_STAMP_NONE;
+    m->names_oscs = 0;
+
+    // The cache key is the message minus the digits of t, hashed as we go
+    char key[ALLES_PARSE_CACHE_KEY_LEN];
+    uint16_t key_len = 0;
+    uint32_t hash = 2166136261u;
+    uint8_t plain = 1; // nothing but per-oscillator fields
+    uint8_t cacheable = !m->sync_response && length < ALLES_PARSE_CACHE_KEY_LEN;
+    uint16_t g_start = 0, g_len = 0;
+
+    // Pull out the alles-specific modes in this message first, so sync traffic never needs AMY's parser
     //fprintf(stderr, "alles messsage %s\n", message);
     while(c < length+1) {
         uint8_t b = message[c];
-        if(b == '_' && c==0) sync_response = 1;
         if( ((b >= 'a' && b <= 'z') || (b >= 'A' && b <= 'Z')) || b == 0) {  // new mode or end
-            if(mode=='g') client = atoi(message + start); 
-            if(mode=='i') sync_index = atoi(message + start);
-            if(sync_response) if(mode=='r') ipv4=atoi(message + start);
-            if(mode=='U') sync = atol(message + start); 
+            if(mode=='g') {
+                m->client = alles_atoi(message + start, c - start);
+                g_start = start;
+                g_len = c - start;
+            }
+            if(mode=='i') m->sync_index = alles_atoi(message + start, c - start);
+            if(m->sync_response) if(mode=='r') m->ipv4 = alles_atoi(message + start, c - start);
+            if(m->sync_response) if(mode=='e') m->every = alles_atoi(message + start, c - start);
+            if(m->sync_response) if(mode=='o') m->free_oscs = alles_atoi(message + start, c - start);
+            if(m->sync_response) if(mode=='B') m->boot_stamp = alles_atol(message + start, c - start);
+            if(mode=='w') {
+                m->sync_window = alles_atoi(message + start, c - start);
+                if(m->sync_window < 0) m->sync_window = 0;
+                if(m->sync_window > ALLES_SYNC_WINDOW_MAX_MS) m->sync_window = ALLES_SYNC_WINDOW_MAX_MS;
+            }
+            if(mode=='x') m->sync_relay = alles_atoi(message + start, c - start);
+            if(mode=='q') m->relayed = 1;
+            if(mode=='m') m->sync_monitor = alles_atoi(message + start, c - start);
+            if(mode=='L') m->latency = alles_atoi(message + start, c - start);
+            if(mode=='P') m->latency_target = alles_atof(message + start, c - start);
+            if(mode=='U') {
+                m->sync = alles_atol(message + start, c - start);
+                m->sync_us = alles_frac_us(message + start, c - start);
+            }
+            if(mode=='L' || mode=='O' || mode=='c') m->names_oscs = 1;
+            if(mode=='t') {
+                m->time = alles_atol(message + start, c - start);
+                m->time_us = alles_frac_us(message + start, c - start);
+            }
+            if(b && !parse_cache_field_ok(b)) plain = cacheable = 0;
             mode = b;
             start = c + 1;
-        } 
+        }
+        if(cacheable && b && (mode != 't' || b == 't')) {
+            key[key_len++] = b;
+            hash = (hash ^ b) * 16777619u;
+        }
         c++;
     }
-    if(sync_response) {
+    if(m->relayed) m->sync_relay = 0;
+    if(m->sync_response || length == 0 || (m->sync >= 0 && m->sync_index >= 0)) return;
+    // Not for us, so don't spend AMY's parser on it. Who plays a g* note depends on the map, so that waits for apply.
+    if(g_len == 1 && message[g_start] == '*') {
+        m->voice = 1;
+    } else if(g_len) {
+        // With virtual synths, parse it if any of them wants it and let apply sort out which
+        m->for_me = 0;
+        for(uint16_t i=0;i<alles_node_count && !m->for_me;i++) m->for_me = alles_targets(alles_nodes[i], message + g_start, g_len);
+        m->target = message + g_start;
+        m->target_len = g_len;
+        if(!m->for_me) return;
+    }
+    if(!plain) {
+        m->parse_later = 1;
+        return;
+    }
+
+    // Without a t AMY stamps the event with its own clock, so only timed messages can reuse a parse
+    struct parse_cache_entry *entry = &cache->entries[hash % ALLES_PARSE_CACHE_ENTRIES];
+    if(cacheable && m->time >= 0 && entry->key_len == key_len && entry->hash == hash &&
+            entry->latency_ms == amy_global.latency_ms && memcmp(entry->key, key, key_len) == 0) {
+        m->e = entry->e;
+        m->e.time = m->time + entry->time_offset;
+        cache->hits++;
+    } else {
+        m->e = amy_parse_message(message + m->mesh_time);
+        if(cacheable && m->time >= 0) {
+            entry->hash = hash;
+            entry->key_len = key_len;
+            entry->latency_ms = amy_global.latency_ms;
+            entry->time_offset = m->e.time - m->time;
+            memcpy(entry->key, key, key_len);
+            entry->e = m->e;
+        }
+        cache->misses++;
+    }
+}
+
+// Act on a decoded message: update the map, answer syncs, fix up the time and queue the event.
+// This changes shared state, so callers apply messages one at a time and in the order each sender sent them.
+static void alles_node_apply(struct alles_message *m) {
+    if(m->sync_response) {
         // If this is a sync response, let's update our local map of who is booted
-        //printf("got sync response client %d ipv4 %d sync %lld\n", client, ipv4, sync);
-        update_map(client, ipv4, sync);
-        length = 0; // don't need to do the rest
+        //printf("got sync response client %d ipv4 %d sync %lld\n", m->client, m->ipv4, m->sync);
+        // A beacon's time is on the mesh clock, so take the master's boot stamp off for its own
+        int64_t clock = m->sync;
+        if(m->sync_index == ALLES_BEACON_INDEX && m->boot_stamp != ALLES_STAMP_NONE) clock -= m->boot_stamp;
+        // A reply the master passed on comes from the master's address with someone else's r, so it would add a
+        // member that isn't there. We hear from whoever sent it in their own pings.
+        if(!m->relayed) update_map(m->client, m->addr, m->ipv4, clock, m->every, m->free_oscs, m->boot_stamp);
+        if(m->sync_index == ALLES_BEACON_INDEX) handle_beacon(m);
+        // Only the master passes replies on. Other synths can see them too, like virtual synths sharing its socket.
+        if(m->sync_relay && m->sync_index >= 0 && alles_is_master()) sync_relay_add(m);
+        return;
+    }
+    if(m->length == 0) return;
+    // Don't add sync messages to the event queue
+    if(m->sync >= 0 && m->sync_index >= 0) {
+        if(m->latency_target > 0 && m->latency_target < 100 && m->latency_target != me->latency_target) {
+            me->latency_target = m->latency_target;
+            me->latency_recommended = -1;
+        }
+        if(m->latency >= 0 && m->latency <= 65535 && m->latency != amy_global.latency_ms) {
+            printf("[%d] latency is now %d ms\n", me->ipv4_quartet, m->latency);
+            amy_global.latency_ms = m->latency;
+        }
+        handle_sync(m);
+        return;
+    }
+    if(!m->for_me) return;
+    if(m->target_len && alles_node_count > 1 && !alles_targets(me, m->target, m->target_len)) return;
+    if(m->voice && !voice_place(m->message, m->length)) return;
+    // A virtual synth moves e.osc into its slice, but can't do the same for oscillators named inside the event
+    if(m->names_oscs && me->osc_count < AMY_OSCS) {
+        static uint8_t warned = 0;
+        if(!warned) fprintf(stderr, "virtual synths can't play events with L, O or c (mod source, algo source, chained osc), dropping them\n");
+        warned = 1;
+        return;
+    }
+
+    // AMY has time always set now.
+    // Latency is already added by AMY as well.
+    // the way this worked we keep a delta of e.time in (already latency added) and our sysclock 
+    // if e.time - delta is > max drift, recompute it !
+    // Once the host has sent us sync requests, the offset comes from those instead.
+    // @ messages are timed on the master's clock, which is our own clock if we are the master.
+    struct event e = m->e;
+    uint8_t timed = (m->time >= 0);
+    struct sender *from = NULL;
+    int32_t delta = e.time - (m->sysclock+amy_global.latency_ms); 
+    if(m->mesh_time && m->time >= 0 && (alles_is_master() || me->mesh_clock.count)) {
+        int64_t delta_us = alles_is_master() ? me->boot_stamp * 1000 : clock_estimator_delta(&me->mesh_clock, m->received_us);
+        e.time = ((int64_t)e.time * 1000 + m->time_us - delta_us + 500) / 1000;
+    } else if(m->mesh_time) {
+        // No master to time it against yet, so play it at latency from now
+        e.time = m->sysclock + amy_global.latency_ms;
+        timed = 0;
     } else {
-        // AMY has time always set now.
-        // Latency is already added by AMY as well.
-        // the way this worked we keep a delta of e.time in (already latency added) and our sysclock 
-        // if e.time - delta is > max drift, recompute it !
-
-        int32_t delta = e.time - (sysclock+amy_global.latency_ms); 
-        if(!computed_delta_set || abs(delta - computed_delta) > ALLES_MAX_DRIFT_MS) {
-            computed_delta = delta;
-            fprintf(stderr,"setting computed delta to %"PRIi32 " (e.time is %"PRIu32 " sysclock %"PRIu32 ") max_drift_ms %"PRIu32 " latency %"PRIu16 "\n", 
-                    computed_delta, e.time, sysclock, (uint32_t)ALLES_MAX_DRIFT_MS, amy_global.latency_ms);
-            computed_delta_set = 1;
-        }  
-        // Adjust our time with computed_delta
-        e.time = e.time - computed_delta;
-
-    }
-    // Only do this if we got some data
-    if(length >0) {
-        // TODO -- not that it matters, but the below could probably be one or two lines long instead
-        // Don't add sync messages to the event queue
-        if(sync >= 0 && sync_index >= 0) {
-            handle_sync(sync, sync_index);
+        // Each controller's clock is its own, so align to whichever one sent this
+        from = sender_find(m->addr, m->sysclock);
+        from->events++;
+        if(from->clock.count) {
+            // Work out when to play in us, and hand AMY the nearest ms to that
+            int64_t delta_us = clock_estimator_delta(&from->clock, m->received_us);
+            int64_t local_us = (int64_t)e.time * 1000 + m->time_us - delta_us;
+            from->computed_delta = (delta_us + (delta_us >= 0 ? 500 : -500)) / 1000;
+            from->computed_delta_set = 1;
+            e.time = (local_us + 500) / 1000;
         } else {
-            // Assume it's for me
-            uint8_t for_me = 1;
-            // But wait, they specified, so don't assume
-            if(client >= 0) {
-                for_me = 0;
-                if(client <= 255) {
-                    // If they gave an individual client ID check that it exists
-                    if(alive>0) { // alive may get to 0 in a bad situation
-                        if(client >= alive) {
-                            client = client % alive;
-                        } 
-                    }
-                }
-                // It's actually precisely for me
-                if(client == client_id) for_me = 1;
-                if(client > 255) {
-                    // It's a group message, see if i'm in the group
-                    if(client_id % (client-255) == 0) for_me = 1;
-                }
+            if(!from->computed_delta_set || abs(delta - from->computed_delta) > ALLES_MAX_DRIFT_MS) {
+                if(from->computed_delta_set) from->resets++;
+                from->computed_delta = delta;
+                const uint8_t *a = (const uint8_t *)&from->addr;
+                fprintf(stderr,"setting computed delta for %d.%d.%d.%d to %"PRIi32 " (e.time is %"PRIu32 " sysclock %"PRIu32 ") max_drift_ms %"PRIu32 " latency %"PRIu16 "\n", 
+                        a[0], a[1], a[2], a[3], from->computed_delta, e.time, m->sysclock, (uint32_t)ALLES_MAX_DRIFT_MS, amy_global.latency_ms);
+                from->computed_delta_set = 1;
             }
-            if(for_me) amy_add_event(e);
+            // Adjust our time with computed_delta
+            e.time = e.time - from->computed_delta + (m->time_us >= 500);
+        }
+    }
+
+    // From what's audible to what AMY is rendering, so it's late if AMY has already rendered past it
+    e.time += alles_output_delay_ms;
+    if(timed) {
+        // How long after it was sent (on our clock) we got round to queueing it, and whether that was too late
+        int64_t now_us = alles_sysclock_us() + alles_output_delay_ms * 1000;
+        latency_stats_add(&me->latency_stats, now_us - ((int64_t)e.time - amy_global.latency_ms) * 1000);
+        if((int64_t)e.time * 1000 < now_us) {
+            me->latency_stats.late++;
+            if(from) from->late++;
         }
     }
-}
\ No newline at end of file
+
+    // A virtual synth plays on its own oscillators
+    if(me->osc_count < AMY_OSCS) e.osc = me->osc_base + e.osc % me->osc_count;
+    if(amy_global.event_qsize >= AMY_EVENT_FIFO_LEN) alles_load.dropped++;
+    ALLES_ADD_EVENT(e);
+    if(amy_global.event_qsize > alles_load.queue_peak) alles_load.queue_peak = amy_global.event_qsize;
+}
+
+void alles_apply_message(struct alles_message *m) {
+    // Once, however many virtual synths there are, since AMY may act on it right there
+    if(m->parse_later && m->for_me) {
+        m->e = amy_parse_message((char *)m->message + m->mesh_time);
+        m->parse_later = 0;
+    }
+    if(alles_node_count == 1) {
+        alles_node_apply(m);
+    } else {
+        struct alles_node *was = me;
+        for(uint16_t i=0;i<alles_node_count;i++) {
+            me = alles_nodes[i];
+            alles_node_apply(m);
+        }
+        me = was;
+    }
+    // Sync traffic can bring a ping, a held reply or a relay flush forward
+    if(m->sync_response || (m->sync >= 0 && m->sync_index >= 0)) poll_next_update();
+}
+
+void alles_parse_message(char *message, uint16_t length) {
+    struct alles_message m;
+    alles_decode_message(message, length, alles_sysclock_us(), message_sender, &parse_cache, &m);
+    alles_apply_message(&m);
+}
@@ -4,6 +4,7 @@
 
 #include <stdio.h>
 #include <stddef.h>
+#include <time.h>
 #ifdef ESP_PLATFORM
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -20,6 +21,7 @@
 #include "lwip/netdb.h"
 #include "wifi_manager.h"
 #include "driver/gpio.h"
+#include "esp_timer.h"
 
 
 #define MAX_TASKS 8
@@ -58,7 +60,7 @@ void delay_ms(uint32_t ms);
 #define UDP_PORT 9294        // port to listen on
 #define MULTICAST_TTL 255     // hops multicast packets can take
 #define MULTICAST_IPV4_ADDR "232.10.11.12"
-#define PING_TIME_MS 10000   // ms between boards pinging each other
+#define PING_TIME_MS 10000   // shortest ms between a board's pings once the mesh is settled
 #define MAX_RECEIVE_LEN 4096
 
 // enums
@@ -76,6 +78,105 @@ void delay_ms(uint32_t ms);
 
 #define ALLES_MAX_DRIFT_MS 20000
 
+// Clock offset estimation from sync requests: how many recent samples we pick the best one from,
+// and how fast computed_delta may move towards it (10 us per ms is 10 ms per second)
+#define ALLES_SYNC_SAMPLES 32
+#define ALLES_CLOCK_SLEW_US_PER_MS 10
+// Clock frequency tracking: shortest span we measure drift over, how long either end of it collects samples
+// for (taking the least delayed, like the offset), how long the first span grows for, and how much each
+// measurement after that counts
+#define ALLES_FREQ_INTERVAL_MS 60000
+#define ALLES_FREQ_WINDOW_MS 10000
+#define ALLES_FREQ_SPAN_MS 600000
+#define ALLES_FREQ_GAIN 4.0f
+
+// The oldest node (client_id 0) is the mesh's time master and sends a beacon this often. Everyone else
+// tracks the master's clock from them, so messages starting with @ can be timed on the mesh clock.
+#define ALLES_BEACON_MS 1000
+#define ALLES_BEACON_INDEX -2
+// Every node works out once when it booted on the mesh clock and says so in its pings (B, in ms), so every
+// node ranks every other the same way. A node that has listened this long (counted from its first poll, since
+// AMY's clock may have been running a while before the network came up), has heard no beacon and no stamped
+// node, and has the lowest address of everyone it has heard, starts the mesh clock itself; the rest take
+// theirs from this many beacons.
+#define ALLES_BOOT_STAMP_WAIT_MS 3000
+#define ALLES_BOOT_STAMP_BEACONS 4
+#define ALLES_STAMP_NONE (-0x7FFFFFFFFFFFFFFFLL)
+
+// How long alles -r keeps rendering after the last message is due, for release tails
+#define ALLES_RENDER_TAIL_MS 3000
+
+// Most nodes the membership table holds. Each one is about 74 bytes of static DRAM, so the ESP32 keeps it to
+// a mesh-sized table (under 10 KB); anyone past that gets in when someone leaves.
+#ifdef ESP_PLATFORM
+#define ALLES_MAX_MEMBERS 128
+#define ALLES_MAX_NODES 1
+#else
+#define ALLES_MAX_MEMBERS 4096
+#define ALLES_MAX_NODES 256 // virtual synths in one process, see alles_add_nodes
+#endif
+
+// Ping scheduling. Nodes ping less often as the mesh grows so the mesh-wide ping rate stays about the same,
+// and faster for a while after anyone joins or leaves so client_ids settle quickly. Every interval is
+// jittered so nodes that powered on together don't ping in lockstep.
+#define ALLES_PING_MAX_MS 60000
+#define ALLES_PING_MS_PER_NODE 250       // about 4 pings a second across the mesh
+#define ALLES_PING_FAST_MS 1000          // shortest interval while membership is changing
+#define ALLES_PING_FAST_MS_PER_NODE 25   // about 40 pings a second across the mesh
+#define ALLES_PING_SETTLE_MS 20000       // how long we stay fast after the last change
+#define ALLES_PING_FIRST_MS 2000         // the first ping after boot lands somewhere in this
+#define ALLES_PING_JITTER 0.25f
+#define ALLES_PING_LOST 2                // pings in a row a member can miss before we drop it
+
+// Sync requests can carry a reply window (w, in ms); we answer at a random point inside it so a room full
+// of synths doesn't answer all at once, and say how long we held the reply (h, in us). With x1 in the
+// request, everyone but the time master hands their reply to the master, which sends them on as one packet.
+#define ALLES_SYNC_PENDING 8             // replies we can be holding at once
+#define ALLES_SYNC_RELAY_MAX 24          // replies the master gathers into one packet
+#define ALLES_SYNC_RELAY_GRACE_MS 50     // how long past the window the master waits for stragglers
+#define ALLES_SYNC_WINDOW_MAX_MS 2000    // longest reply window we honour, anything longer is cut to this
+
+// Room for the longest reply, ping and beacon we can print. A float under %.1f or %.2f can take 43 characters
+// (-FLT_MAX), an int64 20 and any smaller int 11; each field also has its letter, and the
+// NULs of the load and B fields we paste in leave room for the Z and our own NUL.
+#define ALLES_FLOAT_LEN 43
+#define ALLES_LOAD_FIELDS_LEN (3 * (1 + ALLES_FLOAT_LEN) + 3 * (1 + 11) + 1) // c k b, s n d
+#define ALLES_STAMP_FIELD_LEN (1 + 20 + 1) // B
+#define ALLES_REPLY_LEN (2 + 20 + 1 + 11 + 1 + ALLES_FLOAT_LEN + 1 + 20 + 7 * (1 + 11) \
+    + ALLES_LOAD_FIELDS_LEN + ALLES_STAMP_FIELD_LEN + 2) // _U p h, i g r y e l o, load, B, x1
+#define ALLES_PING_LEN (2 + 20 + 3 + 1 + ALLES_FLOAT_LEN + 6 * (1 + 11) + ALLES_LOAD_FIELDS_LEN + ALLES_STAMP_FIELD_LEN)
+#define ALLES_BEACON_LEN (2 + 20 + 1 + 11 + 1 + ALLES_FLOAT_LEN + 6 * (1 + 11) + ALLES_STAMP_FIELD_LEN + 1)
+
+// Latency calibration. We keep a histogram of how late messages reach us compared to the fastest one (one-way
+// network jitter plus parse and queue time), and recommend the latency that would have had ALLES_LATENCY_TARGET
+// percent of them in time to play, plus a margin for rendering. A sync request can ask for a different target
+// (P) and set the latency on every node (L).
+#define ALLES_LATENCY_BUCKETS 256
+#define ALLES_LATENCY_BUCKET_MS 4        // so the histogram covers about a second
+#define ALLES_LATENCY_WINDOW 8192        // halve the counts when we get this many, so old traffic fades
+#define ALLES_LATENCY_MIN_SAMPLES 32     // don't recommend anything until we have this many
+#define ALLES_LATENCY_TARGET 99.9f
+#define ALLES_LATENCY_MARGIN_MS 20
+
+// Per-sender clock offsets. Each controller gets its own delta and sync estimator, so hosts with different
+// clocks can play the same mesh. A sender we haven't heard from in a while gives its slot up.
+#define ALLES_SENDERS 8
+#define ALLES_SENDER_EXPIRE_MS 300000
+
+// Membership expiry wheel. Entries due further out than the wheel spans just wait in their slot for another turn.
+// A member's boot time only moves later by more than this if it rebooted without us noticing it go
+#define ALLES_MEMBER_REBOOT_MS 2000
+#define ALLES_MEMBER_WHEEL_SLOTS 64
+#define ALLES_MEMBER_WHEEL_TICK_MS 1000
+
+// Parsed-message cache size. Each entry holds a struct event plus the key, so keep it small on the ESP
+#ifdef ESP_PLATFORM
+#define ALLES_PARSE_CACHE_ENTRIES 16
+#else
+#define ALLES_PARSE_CACHE_ENTRIES 256
+#endif
+#define ALLES_PARSE_CACHE_KEY_LEN 64
+
 
 // Status mask 
 #define RUNNING 1
@@ -91,20 +192,280 @@ extern void upgrade_tone();
 extern void wifi_tone();
 extern void scale(uint8_t wave);
 
-extern uint8_t alive;
-extern int16_t client_id;
+// A message after decoding: the alles fields, plus the AMY event if it is one
+struct alles_message {
+    int16_t client;
+    int64_t sync;
+    uint16_t sync_us; // fraction of a ms after U, in us
+    int8_t sync_index;
+    int32_t sync_window; // ms we may hold our reply for, 0 to answer right away
+    int32_t latency; // L in a sync request: latency to use from now on, -1 if none
+    float latency_target; // P in a sync request: percentile to recommend latency for, 0 if none
+    uint8_t sync_relay; // request: send the reply through the master. reply: it's one to pass on
+    uint8_t sync_monitor; // m1 in a request: only after our reply, not syncing, so leave our clocks alone
+    uint8_t relayed; // q in a reply: the master passed it on, so addr is the master's and not the sender's
+    uint8_t names_oscs; // L, O or c: AMY's mod source, algorithm operators or chained osc, which name other oscillators
+    uint8_t ipv4;
+    uint32_t addr; // who sent it, in network order
+    int64_t time; // t as sent, -1 if none
+    uint16_t time_us; // fraction of a ms after t, in us
+    uint32_t sysclock; // our clock when the message arrived
+    int64_t received_us; // the same, in us
+    uint16_t length;
+    const char *message; // the text, only good until the message is applied
+    uint8_t sync_response;
+    int32_t every; // ms until the sender's next ping, -1 if it didn't say
+    uint8_t mesh_time; // t is on the mesh clock, not the sender's
+    uint8_t for_me; // g leaves us out, so there's no event to apply
+    uint8_t parse_later; // AMY may act on it as it parses, so e is only filled in when it's applied
+    const char *target; // the g list, for sorting out which virtual synths it's for
+    uint16_t target_len;
+    uint8_t voice; // g*: the mesh picks who plays it, see voice_place
+    int16_t free_oscs; // o in a reply: oscillators the sender has free, -1 if it didn't say
+    int64_t boot_stamp; // B in a reply: when the sender booted on the mesh clock, ALLES_STAMP_NONE if it didn't say
+    struct event e;
+};
+
+struct parse_cache_entry {
+    uint32_t hash;
+    uint16_t key_len; // 0 is an empty slot
+    uint16_t latency_ms; // latency in effect when we parsed, it's baked into the time offset
+    int32_t time_offset; // e.time - t as AMY computed it
+    char key[ALLES_PARSE_CACHE_KEY_LEN];
+    struct event e;
+};
+
+struct parse_cache {
+    struct parse_cache_entry entries[ALLES_PARSE_CACHE_ENTRIES];
+    uint32_t hits;
+    uint32_t misses;
+};
+
+struct clock_estimator {
+    int64_t samples[ALLES_SYNC_SAMPLES]; // remote send time - our receive time, in us
+    int64_t sample_times[ALLES_SYNC_SAMPLES]; // our clock when we took each sample (all times here are in us)
+    uint8_t count;
+    uint8_t next;
+    int64_t target_us;   // the minimum delay sample, brought forward for drift
+    int64_t target_time; // our clock when target was measured
+    int64_t delta_us;    // the offset we are using, slewing towards target
+    int64_t last_slew;   // our clock when we last slewed
+    float ppm;           // how fast the remote clock gains on ours
+    uint8_t freq_locked;
+    int64_t ref_offset_us; // best raw sample in the window starting at ref_time
+    int64_t ref_time;
+    uint8_t measuring;     // collecting the far end of a drift measurement, starting at measure_time
+    int64_t measure_offset_us;
+    int64_t measure_time;
+    float measure_base_ppm; // ppm before this measurement, which it keeps refining until the window closes
+};
+
+struct latency_stats {
+    uint32_t buckets[ALLES_LATENCY_BUCKETS]; // ALLES_LATENCY_BUCKET_MS each, the last one also counts anything past it
+    uint32_t count;
+    uint32_t added; // all samples ever, not halved
+    uint32_t late; // events that reached us after they should have played
+};
+
+// How close we are to running out of time, reported in pings and sync replies. The window resets with each report.
+struct alles_load {
+    uint32_t blocks;     // blocks rendered in this window
+    uint32_t render_us;  // time spent rendering them
+    uint32_t peak_us;    // the longest one
+    uint16_t queue_peak; // deepest AMY's event queue got
+    uint32_t dropped;    // events handed to AMY with its queue full, since boot
+    uint32_t split_blocks;   // blocks rendered across more than one core or thread
+    float imbalance_sum;     // how much longer than the average part the slowest one took, summed, in %
+    float imbalance_peak;
+};
+
+// Splitting a block's oscillators across cores or threads so each gets the same work. Each oscillator
+// costs what its wave type costs (the last kind is oscillators that aren't playing), learned from how long
+// each part takes to render, and the next block is cut so every part's predicted cost comes out even.
+// Each part then only renders from its first audible oscillator to its last, so a block costs what's
+// playing rather than AMY_OSCS: the silent oscillators around the voices aren't even looked at.
+#define ALLES_RENDER_MAX_PARTS 8
+#define ALLES_COST_KINDS 16
+#define ALLES_COST_RATE 0.05f // how far each block's timings move the learned costs
+struct alles_partition {
+    uint8_t parts;
+    uint16_t bounds[ALLES_RENDER_MAX_PARTS + 1]; // part k's share is oscillators [bounds[k], bounds[k+1])
+    uint16_t start[ALLES_RENDER_MAX_PARTS];      // of which it renders [start[k], end[k]), the audible ones and
+    uint16_t end[ALLES_RENDER_MAX_PARTS];        // whatever's between them
+    uint16_t active[AMY_OSCS];       // the audible oscillators this block, in order
+    uint16_t active_count;
+    float cost_us[ALLES_COST_KINDS]; // one oscillator of each kind
+    float base_us;                   // a part with no oscillators
+    uint8_t kinds[AMY_OSCS];         // each oscillator's kind when the bounds were cut
+};
+
+struct sender {
+    uint32_t addr; // network order
+    uint8_t used;
+    int64_t last_seen; // our clock, ms
+    int32_t computed_delta; // their clock - ours, from the first event, until they sync us
+    uint8_t computed_delta_set;
+    struct clock_estimator clock; // from their sync requests
+    uint32_t events;
+    uint32_t late;
+    uint32_t resets; // times computed_delta was off by more than ALLES_MAX_DRIFT_MS and was taken again
+};
+
+// Membership table of booted devices. Entries are keyed on the sender's full IPv4 address plus its ipv4 tag
+// (the last octet plus the desktop instance offset), so nodes on different subnets or several instances on
+// one host never share one. Nodes are ranked on the boot stamp they advertise, then the key, which every
+// node sees the same; only nodes that haven't stamped yet fall back to our own estimate of their boot. It's a chained hash over a fixed pool, and an entry keeps its index while it is
+// live so the expiry wheel can link entries by index. Rather than rescanning the table on each ping,
+// we keep the live count and the number of live nodes that booted before us current as entries change,
+// and silent nodes fall out of a timer wheel keyed on when they expire.
+#define MEMBER_NONE 0xFFFF
+struct member {
+    uint64_t key;       // address and tag, see member_key
+    uint8_t ipv4;
+    int64_t clock;      // their clock in their last ping or sync response
+    int64_t ping_time;  // our clock when we got it
+    int64_t boot;       // when they booted on our clock, from the least delayed ping
+    int64_t stamp;      // when they booted on the mesh clock, as they told us, ALLES_STAMP_NONE until they do
+    int64_t expire_time; // our clock when we give up on them
+    uint8_t live;
+    uint8_t older;      // booted before us, so counts towards our client_id
+    int16_t free_oscs;  // oscillators free in their last report, -1 if they never said
+    uint16_t next;      // links within the wheel slot
+    uint16_t prev;
+    uint16_t slot;
+    uint16_t chain;     // next in the hash bucket, or in the free list
+};
+
+// Sync replies we are holding back, and (as time master) replies we are gathering to pass on
+struct sync_reply {
+    int64_t send_time; // ms, 0 is a free slot
+    int64_t received_us;
+    int8_t index;
+    uint8_t relay;
+    float ppm;
+};
+struct sync_relayed {
+    char text[180];
+    int64_t received_us;
+};
+
+// Everything one synth knows about itself and the mesh. A process is usually one synth, but alles -v runs
+// several virtual ones that share the socket, the parse and AMY (each plays on its own slice of the
+// oscillators). Messages are applied to each in turn with me pointing at it.
+struct alles_node {
+    uint32_t ipv4_address; // network order
+    uint8_t ipv4_quartet;  // our tag: the last octet, plus the instance offset
+    int16_t client_id;
+    uint16_t alive;
+    uint16_t osc_base;     // our slice of AMY's oscillators
+    uint16_t osc_count;
+
+    struct member members[ALLES_MAX_MEMBERS];
+    uint16_t member_buckets[ALLES_MAX_MEMBERS];
+    uint16_t member_free;
+    uint16_t member_wheel[ALLES_MEMBER_WHEEL_SLOTS];
+    int64_t member_wheel_tick; // last wheel tick we have expired everything for
+    uint16_t members_older;
+    uint16_t members_stamped; // live members that have told us their boot stamp
+    int64_t boot_stamp;       // when we booted on the mesh clock, in ms, ALLES_STAMP_NONE until we know
+    int64_t listen_start;     // our clock at our first poll, -1 before it
+    uint8_t beacon_heard;     // anyone has sent us a beacon, so there is a mesh clock to take
+
+    struct sender senders[ALLES_SENDERS]; // each controller's clock offset, see sender_find
+    float sync_ppm; // drift of the host that synced us last, reported in pings and beacons
+    struct clock_estimator mesh_clock; // the time master's clock offset, measured from its beacons
+    uint16_t mesh_master; // member entry of the master we are tracking
+    int64_t last_beacon_time;
+
+    struct sync_reply sync_pending[ALLES_SYNC_PENDING];
+    struct sync_relayed sync_relay[ALLES_SYNC_RELAY_MAX];
+    uint8_t sync_relay_count;
+    int64_t sync_relay_flush;
+
+    struct latency_stats latency_stats;
+    float latency_target;
+    int32_t latency_recommended; // cached latency_recommend()
+    uint32_t latency_recommended_at;
+
+    int64_t next_ping_time; // 0 until the first ping is scheduled
+    int64_t ping_fast_until;
+    uint32_t ping_seed;
+};
+
+extern struct alles_node *me; // the synth we are working for right now
+extern struct alles_node *alles_nodes[ALLES_MAX_NODES];
+extern uint16_t alles_node_count;
+extern struct alles_load alles_load;
+extern struct alles_partition alles_partition;
+extern uint32_t message_sender;
+extern struct parse_cache parse_cache;
 
 void ping(int64_t sysclock);
+void beacon(int64_t sysclock);
+void alles_poll();
+int32_t alles_poll_wait_ms();
+int64_t ping_interval(uint16_t nodes, uint8_t fast);
+int64_t ping_jitter(int64_t interval, uint32_t r);
 amy_err_t sync_init();
+void parse_cache_init(struct parse_cache *cache);
 
-extern  void update_map(int16_t client, uint8_t ipv4, int64_t time);
-extern void handle_sync(int64_t time, int8_t index);
+extern  void update_map(int16_t client, uint32_t addr, uint8_t ipv4, int64_t time, int32_t every, int16_t free_oscs, int64_t stamp);
+int16_t alles_free_oscs();
+void alles_add_nodes(uint16_t n);
+void alles_set_address(uint32_t addr, uint8_t quartet);
+struct alles_node *alles_node_new(uint32_t addr, uint8_t quartet);
+void alles_node_select(struct alles_node *n);
+extern void handle_sync(struct alles_message *m);
+void alles_print_senders();
+int64_t alles_sysclock_us();
+int64_t alles_sysclock_ms();
+void alles_block_start();
+extern uint16_t alles_output_delay_ms;
+extern uint8_t alles_offline;
+void latency_stats_init(struct latency_stats *l);
+void latency_stats_add(struct latency_stats *l, int64_t us);
+int32_t latency_stats_percentile(struct latency_stats *l, float percentile);
+int32_t latency_recommend();
+void alles_render_block(uint32_t us);
+void alles_partition_init(uint8_t parts);
+void alles_partition_plan();
+void alles_partition_measured(const uint32_t *us);
+void clock_estimator_init(struct clock_estimator *c);
+void clock_estimator_sample(struct clock_estimator *c, int64_t remote_us, int64_t local_us);
+int64_t clock_estimator_delta(struct clock_estimator *c, int64_t now_us);
 extern void mcast_send(char * message, uint16_t len);
+extern void udp_send(uint32_t addr, char * message, uint16_t len);
 #ifndef ESP_PLATFORM
 extern void *mcast_listen_task(void *vargp);
 #endif
 extern void create_multicast_ipv4_socket();
+
+// Where alles_parse_message hands events that are for us. The bench and fuzz builds point this
+// at a stub so the parser can run without an audio device.
+#ifndef ALLES_ADD_EVENT
+#define ALLES_ADD_EVENT amy_add_event
+#else
+extern void ALLES_ADD_EVENT(struct event e);
+#endif
+// A steady us clock for counting on from the start of a block, see alles_block_start. The sim points this
+// at each node's own clock.
+#ifndef ALLES_MONOTONIC_US
+#ifdef ESP_PLATFORM
+#define ALLES_MONOTONIC_US esp_timer_get_time
+#else
+#define ALLES_MONOTONIC_US alles_monotonic_us
+int64_t alles_monotonic_us();
+#endif
+#else
+extern int64_t ALLES_MONOTONIC_US();
+#endif
 void alles_parse_message(char *message, uint16_t length);
+void alles_decode_message(char *message, uint16_t length, int64_t received_us, uint32_t addr, struct parse_cache *cache, struct alles_message *m);
+void alles_apply_message(struct alles_message *m);
+int64_t alles_atol(const char *s, uint16_t len);
+int32_t alles_atoi(const char *s, uint16_t len);
+float alles_atof(const char *s, uint16_t len);
+uint16_t alles_frac_us(const char *s, uint16_t len);
 
 
 
@@ -0,0 +1,303 @@
+// alles_bench.c
+// Parser throughput harness and libFuzzer target for alles_parse_message.
+// Links alles.c and the AMY parser, no audio device. Built by `make bench-parse` / `make fuzz-parse`.
+#include "alles.h"
+#include <time.h>
+
+// alles.c expects these from the multicast / platform files
+uint8_t battery_mask = 0;
+uint8_t ipv4_quartet = 10;
+uint32_t ipv4_address; // 10.0.0.10, set in main
+char githash[8];
+char *message_start_pointer;
+int16_t message_length;
+
+uint32_t bench_events = 0;
+uint32_t bench_sends = 0;
+
+// alles.c is compiled with -DALLES_ADD_EVENT=bench_add_event for this build
+void bench_add_event(struct event e) {
+    bench_events++;
+}
+
+void mcast_send(char * message, uint16_t len) {
+    bench_sends++;
+}
+
+void udp_send(uint32_t addr, char * message, uint16_t len) {
+    bench_sends++;
+}
+
+// Split a datagram into Z-delimited messages the same way mcast_listen_task does
+static void bench_parse_packet(char *packet, uint16_t len) {
+    uint16_t start = 0;
+    for(uint16_t i=0;i<len;i++) {
+        if(packet[i] == 'Z') {
+            packet[i] = 0;
+            message_start_pointer = packet + start;
+            message_length = i - start;
+            alles_parse_message(message_start_pointer, message_length);
+            start = i+1;
+        }
+    }
+}
+
+#ifdef ALLES_FUZZ
+
+// Numbers in the protocol grammar should read the same as libc would read them
+static void fuzz_check_numbers(const uint8_t *data, size_t size) {
+    char buf[20];
+    if(size == 0 || size >= sizeof(buf)) return;
+    for(size_t i=0;i<size;i++) {
+        if(!((data[i] >= '0' && data[i] <= '9') || data[i] == '-' || data[i] == '+' || data[i] == '.')) return;
+    }
+    memcpy(buf, data, size);
+    buf[size] = 0;
+    if(size <= 18 && alles_atol(buf, size) != atoll(buf)) abort();
+    if(size <= 9) {
+        float want = atof(buf);
+        float got = alles_atof(buf, size);
+        float err = got - want;
+        if(err < 0) err = -err;
+        if(err > 1e-4f * (want < 0 ? -want : want) + 1e-6f) abort();
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static uint8_t started = 0;
+    static char packet[MAX_RECEIVE_LEN];
+    if(!started) {
+        sync_init();
+        amy_start(1,0,0,0);
+        amy_global.latency_ms = ALLES_LATENCY_MS;
+        started = 1;
+    }
+    fuzz_check_numbers(data, size);
+    if(size > sizeof(packet)-1) size = sizeof(packet)-1;
+    memcpy(packet, data, size);
+    packet[size] = 0;
+    bench_parse_packet(packet, size);
+    return 0;
+}
+
+#else
+
+// A mix of what the mesh actually carries: sync requests from alles.py sync(), ping and sync replies,
+// individual, group and list addressed notes (one for us, one not), and notes with breakpoints.
+static const char *corpus[] = {
+    "U3600123i3Z",
+    "_U3456789i-1g2r45y16Z",
+    "_U3456789i3g2r45y16Z",
+    "t3600250v0w8n60l1Z",
+    "t3600250v0l0Z",
+    "t3600312.5v1w8n64l1Z",
+    "t3600375v3p8l1g1Z",
+    "t3600500v2w0f440A0,1,500,0,0,0a0,0,1l1g257Z",
+    "t3600625v1w1n48l0.8A10,1,250,0.7,750,0B0,1,100,0.2,500,0T1W0Z",
+    "t3600750v4p9l1g258Z",
+    "t3600875v7w0n36l1.2F200R2.5G0Z",
+    "t3600937v5w1n67l1g1,3,5-9Z",
+    "t3600968v5w1n67l1g2,5,9-17Z",
+    NULL
+};
+
+static double bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static int bench_parse(int iterations) {
+    char packet[MAX_RECEIVE_LEN];
+    uint32_t messages = 0;
+    // Nothing renders here, so put AMY's clock where the corpus times are, an hour in, or we'd be at 0 and
+    // never in our own map
+    amy_global.total_samples = (int64_t)3600 * AMY_SAMPLE_RATE;
+    double start = bench_now_ns();
+    for(int n=0;n<iterations;n++) {
+        for(uint16_t i=0;corpus[i] != NULL;i++) {
+            uint16_t len = strlen(corpus[i]);
+            // recvfrom would have written a fresh copy, and the splitter writes NULs into it
+            memcpy(packet, corpus[i], len+1);
+            bench_parse_packet(packet, len);
+            messages++;
+        }
+    }
+    double elapsed = bench_now_ns() - start;
+    printf("parse: %" PRIu32 " messages in %.3f s, %.0f messages/s, %.1f ns/message (%" PRIu32 " events queued, %" PRIu32 " replies sent)\n",
+        messages, elapsed / 1e9, messages / (elapsed / 1e9), elapsed / messages, bench_events, bench_sends);
+    printf("parse cache: %" PRIu32 " hits %" PRIu32 " misses\n", parse_cache.hits, parse_cache.misses);
+    return 0;
+}
+
+// Address of the nth bench node: 10.0.x.y, 250 to a /24, so last octets repeat across subnets
+static uint32_t bench_node_address(uint16_t n) {
+    uint32_t addr;
+    uint8_t *a = (uint8_t *)&addr;
+    a[0] = 10; a[1] = 0; a[2] = n / 250; a[3] = n % 250 + 1;
+    return addr;
+}
+
+// Every node in an n node mesh pinging once a round, all landing on us
+static int bench_membership(int rounds, uint16_t nodes) {
+    uint32_t updates = 0;
+    sync_init();
+    // AMY's clock stands still without audio running. Move ours on far enough that everyone's clock is positive,
+    // update_map ignores the rest.
+    int64_t ahead_ms = (int64_t)nodes * 10;
+    if((int64_t)amy_sysclock() <= ahead_ms) amy_global.total_samples = ahead_ms * AMY_SAMPLE_RATE / 1000;
+    double start = bench_now_ns();
+    for(int r=0;r<rounds;r++) {
+        for(uint16_t n=0;n<nodes;n++) {
+            // Their clocks run alongside ours, with boot times spread out on either side of ours
+            update_map(n % 64, bench_node_address(n), n % 250 + 1, (int64_t)amy_sysclock() + (n * 37 % nodes) * 10 - nodes * 5 + 1, -1, -1, ALLES_STAMP_NONE);
+            updates++;
+        }
+    }
+    double elapsed = bench_now_ns() - start;
+    if(me->alive != nodes) {
+        fprintf(stderr, "membership: %d nodes but %d alive, the timings don't mean anything\n", nodes, me->alive);
+        return 1;
+    }
+    printf("membership: %d nodes, %" PRIu32 " updates in %.3f s, %.1f ns/update, %d alive, my client_id %d\n",
+        nodes, updates, elapsed / 1e9, elapsed / updates, me->alive, me->client_id);
+    return 0;
+}
+
+// Ping load with the real schedule (ping_interval / ping_jitter), for nodes that all power on within 30 s of
+// each other and then run for ten minutes. Each node reacts to membership changes the way alles_poll does.
+struct sim_node {
+    int64_t boot;
+    int64_t next_ping;
+    int64_t fast_until;
+    uint16_t known;
+    uint32_t seed;
+};
+
+static uint32_t sim_random(struct sim_node *n) {
+    n->seed ^= n->seed << 13;
+    n->seed ^= n->seed >> 17;
+    n->seed ^= n->seed << 5;
+    return n->seed;
+}
+
+static void sim_changed(struct sim_node *n, int64_t now) {
+    n->fast_until = now + ALLES_PING_SETTLE_MS;
+    int64_t fast = ping_interval(n->known, 1);
+    if(n->next_ping > now + fast) n->next_ping = now + sim_random(n) % fast;
+}
+
+static int bench_ping_nodes(uint16_t nodes) {
+    const int64_t run_ms = 600000;
+    const int64_t steady_from = 300000;
+    struct sim_node *node = calloc(nodes, sizeof(struct sim_node));
+    uint8_t *heard = calloc((size_t)nodes * nodes, 1);
+    srand(nodes);
+    int64_t last_boot = 0;
+    for(uint16_t i=0;i<nodes;i++) {
+        node[i].boot = rand() % 30000;
+        node[i].seed = 0x9E3779B9u ^ (i * 2654435761u);
+        node[i].next_ping = -1;
+        node[i].known = 1; // itself
+        if(node[i].boot > last_boot) last_boot = node[i].boot;
+    }
+    uint32_t total_pings = 0, steady_pings = 0;
+    int64_t converged = -1;
+    uint32_t complete = 0; // nodes that know everyone
+    for(int64_t now=0;now<run_ms;now+=10) {
+        for(uint16_t i=0;i<nodes;i++) {
+            struct sim_node *n = &node[i];
+            if(now < n->boot) continue;
+            if(n->next_ping < 0) {
+                n->next_ping = now + sim_random(n) % ALLES_PING_FIRST_MS;
+                n->fast_until = now + ALLES_PING_SETTLE_MS;
+            }
+            if(now < n->next_ping) continue;
+            n->next_ping = now + ping_jitter(ping_interval(n->known, now < n->fast_until), sim_random(n));
+            total_pings++;
+            if(now >= steady_from) steady_pings++;
+            for(uint16_t j=0;j<nodes;j++) {
+                if(j == i || now < node[j].boot || heard[(size_t)j * nodes + i]) continue;
+                heard[(size_t)j * nodes + i] = 1;
+                node[j].known++;
+                if(node[j].known == nodes) complete++;
+                sim_changed(&node[j], now);
+            }
+        }
+        if(converged < 0 && complete == nodes) converged = now;
+    }
+    float steady_rate = steady_pings / ((run_ms - steady_from) / 1000.0f);
+    printf("ping: %3d nodes: all know each other %5.1f s after the last boot, %6" PRIu32 " pings in all, steady %5.2f pings/s (each node receives %5.2f/s; %5.2f/s with a fixed %d s ping)\n",
+        nodes, (converged - last_boot) / 1000.0f, total_pings, steady_rate, steady_rate * (nodes - 1) / nodes,
+        (nodes - 1) * 1000.0f / PING_TIME_MS, PING_TIME_MS / 1000);
+    free(node);
+    free(heard);
+    return converged < 0;
+}
+
+static int bench_ping() {
+    return bench_ping_nodes(16) | bench_ping_nodes(64) | bench_ping_nodes(256);
+}
+
+// Simulated host whose crystal runs skew_ppm fast, sync()ing every two minutes with 2-16 ms of one-way
+// delay. Checks the frequency estimate and the offset we'd use halfway between syncs. Times are in us.
+static int bench_clock(int rounds) {
+    const float skew_ppm = 40.0f;
+    const int64_t offset0 = 1234567890;
+    const int64_t min_delay = 2000;
+    struct clock_estimator c;
+    clock_estimator_init(&c);
+    srand(1);
+    float worst_ms = 0;
+    int64_t local = 1000000;
+    for(int r=0;r<rounds;r++) {
+        // A sync() round: 10 requests, 100 ms apart
+        for(uint8_t i=0;i<10;i++) {
+            int64_t remote = offset0 + (int64_t)((double)local * (1.0 + skew_ppm / 1e6));
+            int64_t delay = min_delay + rand() % 14000;
+            clock_estimator_sample(&c, remote, local + delay);
+            local += 100000;
+        }
+        // Then run without syncs, slewing as events would, and look at the midpoint
+        for(int64_t t=0;t<120000000;t+=100000) {
+            int64_t delta = clock_estimator_delta(&c, local);
+            if(t == 60000000 && r >= rounds / 2) {
+                double truth = offset0 + (double)local * (skew_ppm / 1e6) - min_delay;
+                float err = (float)(delta - truth) / 1000.0f;
+                if(err < 0) err = -err;
+                if(err > worst_ms) worst_ms = err;
+            }
+            local += 100000;
+        }
+    }
+    uint8_t ok = (c.ppm > skew_ppm - 5 && c.ppm < skew_ppm + 5 && worst_ms <= 2.0f);
+    printf("clock: injected %.1f ppm, estimated %.2f ppm, worst offset error between syncs %.3f ms over the last %d syncs: %s\n",
+        skew_ppm, c.ppm, worst_ms, rounds - rounds / 2, ok ? "ok" : "FAIL");
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char ** argv) {
+    int iterations = 100000;
+    const char *mode = "parse";
+    if(argc > 1) mode = argv[1];
+    if(argc > 2) iterations = atoi(argv[2]);
+
+    ipv4_address = bench_node_address(9);
+    sync_init();
+    alles_set_address(ipv4_address, ipv4_quartet);
+    amy_start(1,0,0,0);
+    amy_global.latency_ms = ALLES_LATENCY_MS;
+
+    if(strcmp(mode, "parse") == 0) return bench_parse(iterations);
+    if(strcmp(mode, "membership") == 0) {
+        // Cost per update should stay flat as the mesh grows
+        if(bench_membership(iterations / 16, 255)) return 1;
+        return bench_membership(iterations / 256, 4000);
+    }
+    if(strcmp(mode, "ping") == 0) return bench_ping();
+    if(strcmp(mode, "clock") == 0) return bench_clock(argc > 2 ? iterations : 30);
+    fprintf(stderr, "usage: alles_bench [parse|membership|clock|ping] [iterations]\n");
+    return 1;
+}
+
+#endif
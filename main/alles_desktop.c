@@ -4,6 +4,7 @@
 #include "alles.h"
 #include <pthread.h>
 #include <unistd.h>
+#include <time.h>
 
 uint8_t board_level = ALLES_DESKTOP;
 uint8_t status = RUNNING;
@@ -22,22 +23,126 @@ uint8_t quartet_offset = 0;
 extern int get_first_ip_address(char *host);
 extern void print_devices();
 extern amy_err_t sync_init();
+extern void parse_workers_start(uint8_t n);
+extern int rt_policy, rt_audio_cpu, rt_network_cpu;
+extern uint8_t rt_lock;
+extern int rt_parse_policy(const char *name);
+extern int rt_threads(int *tids, int max);
+extern void rt_audio_threads(const int *before, int n_before);
+extern void rt_network_threads(const int *before, int n_before);
+extern void rt_lock_memory();
+extern void rt_started();
+extern void rt_report();
+extern int render_ahead_start(uint8_t blocks);
+extern uint8_t render_pool_start(uint8_t threads);
+extern int16_t *render_block();
+extern void render_ahead_report();
 
-char *local_ip, *raw_file;
+char *local_ip, *raw_file = NULL;
+char *wav_file = "alles.wav";
 
-int main(int argc, char ** argv) {
-    sync_init();
-    amy_start(1,0,1,0);
-    amy_reset_oscs();
-    amy_global.latency_ms = ALLES_LATENCY_MS;
+static void wav_write_header(FILE *f, uint32_t data_bytes) {
+    uint32_t u32;
+    uint16_t u16;
+    fwrite("RIFF", 1, 4, f);
+    u32 = 36 + data_bytes; fwrite(&u32, 4, 1, f);
+    fwrite("WAVEfmt ", 1, 8, f);
+    u32 = 16; fwrite(&u32, 4, 1, f);
+    u16 = 1; fwrite(&u16, 2, 1, f); // PCM
+    u16 = AMY_NCHANS; fwrite(&u16, 2, 1, f);
+    u32 = AMY_SAMPLE_RATE; fwrite(&u32, 4, 1, f);
+    u32 = AMY_SAMPLE_RATE * AMY_NCHANS * AMY_BYTES_PER_SAMPLE; fwrite(&u32, 4, 1, f);
+    u16 = AMY_NCHANS * AMY_BYTES_PER_SAMPLE; fwrite(&u16, 2, 1, f);
+    u16 = AMY_BYTES_PER_SAMPLE * 8; fwrite(&u16, 2, 1, f);
+    fwrite("data", 1, 4, f);
+    fwrite(&data_bytes, 4, 1, f);
+}
 
+// Render a message log to a WAV file as fast as we can, with no sound device or network. Each line of the log
+// is the ms it arrived and the datagram, like "1523 v0n60l1t2523Z". AMY's clock is its sample count, so
+// feeding each line in once the render reaches its arrival time plays it the way the mesh would have.
+int render_offline(char *log_file, char *out_file) {
+    FILE *log = fopen(log_file, "r");
+    if(log == NULL) {
+        fprintf(stderr, "can't open message log %s\n", log_file);
+        return 1;
+    }
+    FILE *out = fopen(out_file, "wb");
+    if(out == NULL) {
+        fprintf(stderr, "can't write %s\n", out_file);
+        fclose(log);
+        return 1;
+    }
+    wav_write_header(out, 0);
+    // We are the whole mesh, so every client or group address plays here
+    alles_set_address(0x0100007f, 0);
+    alles_offline = 1;
+    message_sender = 0x0100007f;
+
+    char line[MAX_RECEIVE_LEN + 32];
+    uint8_t have_line = 0;
+    int64_t first_ms = -1, arrival_ms = 0, end_ms = 0;
+    uint32_t messages = 0, blocks = 0;
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(1) {
+        int64_t now_ms = amy_global.total_samples * 1000 / AMY_SAMPLE_RATE;
+        // Hand over everything that has arrived by now
+        while(1) {
+            if(!have_line) {
+                if(fgets(line, sizeof(line), log) == NULL) break;
+                if(line[0] == '#' || line[0] == '\n') continue;
+                int64_t t = strtoll(line, NULL, 10);
+                if(first_ms < 0) first_ms = t;
+                arrival_ms = t - first_ms;
+                have_line = 1;
+            }
+            if(arrival_ms > now_ms) break;
+            char *datagram = strchr(line, ' ');
+            datagram = datagram ? datagram + 1 : line;
+            uint16_t len = strcspn(datagram, "\r\n");
+            uint16_t start_at = 0;
+            for(uint16_t i=0;i<len;i++) {
+                if(datagram[i] == 'Z') {
+                    datagram[i] = 0;
+                    alles_parse_message(datagram + start_at, i - start_at);
+                    messages++;
+                    start_at = i+1;
+                }
+            }
+            end_ms = arrival_ms + amy_global.latency_ms + ALLES_RENDER_TAIL_MS;
+            have_line = 0;
+        }
+        if(!have_line && feof(log) && now_ms >= end_ms) break;
+        int16_t *block = render_block();
+        fwrite(block, AMY_BYTES_PER_SAMPLE, AMY_BLOCK_SIZE * AMY_NCHANS, out);
+        blocks++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    uint32_t data_bytes = blocks * AMY_BLOCK_SIZE * AMY_NCHANS * AMY_BYTES_PER_SAMPLE;
+    fseek(out, 0, SEEK_SET);
+    wav_write_header(out, data_bytes);
+    fclose(out);
+    fclose(log);
+    double audio_s = (double)blocks * AMY_BLOCK_SIZE / AMY_SAMPLE_RATE;
+    double wall_s = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Rendered %" PRIu32 " messages to %.2f s of audio in %s in %.3f s, %.1fx realtime\n",
+        messages, audio_s, out_file, wall_s, wall_s > 0 ? audio_s / wall_s : 0);
+    return 0;
+}
+
+int main(int argc, char ** argv) {
     // For now, indicate ip address via commandline
     local_ip = (char*)malloc(sizeof(char)*1025);
     local_ip[0] = 0;    
     get_first_ip_address(local_ip);
 
     int opt;
-    while((opt = getopt(argc, argv, ":i:d:c:r:o:lgh")) != -1) 
+    uint8_t workers = 0;
+    uint16_t nodes = 1;
+    uint8_t ahead = 0;
+    uint8_t render_threads = 1;
+    while((opt = getopt(argc, argv, ":i:d:c:r:w:o:p:v:a:t:R:A:N:mlgh")) != -1) 
     { 
         switch(opt) 
         { 
@@ -45,14 +150,41 @@ int main(int argc, char ** argv) {
                 strcpy(local_ip, optarg);
                 break;
             case 'r': 
-                strcpy(raw_file, optarg);
+                raw_file = optarg;
                 break; 
+            case 'w':
+                wav_file = optarg;
+                break;
             case 'd': 
                 amy_playback_device_id = atoi(optarg);
                 break;
             case 'o': 
                 quartet_offset = atoi(optarg);
                 break; 
+            case 'p':
+                workers = atoi(optarg);
+                break;
+            case 'v':
+                nodes = atoi(optarg);
+                break;
+            case 'a':
+                ahead = atoi(optarg);
+                break;
+            case 't':
+                render_threads = atoi(optarg);
+                break;
+            case 'R':
+                rt_policy = rt_parse_policy(optarg);
+                break;
+            case 'A':
+                rt_audio_cpu = atoi(optarg);
+                break;
+            case 'N':
+                rt_network_cpu = atoi(optarg);
+                break;
+            case 'm':
+                rt_lock = 1;
+                break;
             case 'l':
                 amy_print_devices();
                 return 0;
@@ -61,6 +193,15 @@ int main(int argc, char ** argv) {
                 printf("usage: alles\n\t[-i multicast interface ip address, default, autodetect]\n");
                 printf("\t[-d sound device id, use -l to list, default, autodetect]\n");
                 printf("\t[-o offset for client ID, use for multiple copies of this program on the same host, default is 0]\n");
+                printf("\t[-p number of parse worker threads, default is 0, parse on the network thread]\n");
+                printf("\t[-v number of synths to run in this process, each on its own share of the oscillators, default 1]\n");
+                printf("\t[-r message log to render to a file as fast as possible, with no sound device or network]\n");
+                printf("\t[-w file -r renders to, default alles.wav]\n");
+                printf("\t[-a render this many blocks ahead on a thread of its own, default 0, render in the sound callback]\n");
+                printf("\t[-t number of threads to render on, each with its share of the oscillators, default 1; more than 1 renders ahead]\n");
+                printf("\t[-R fifo or rr, run the audio and network threads real-time with that policy (Linux), default is not to]\n");
+                printf("\t[-A cpu to pin the audio threads to, -N cpu for the network threads (Linux), default is any]\n");
+                printf("\t[-m lock all memory in RAM and prefault it (Linux)]\n");
                 printf("\t[-l list all sound devices and exit]\n");
                 printf("\t[-h show this help and exit]\n");
                 return 0;
@@ -73,10 +214,32 @@ int main(int argc, char ** argv) {
                 break; 
         } 
     }
-    amy_live_start();
+    // Whatever threads each step starts are the ones to make real-time / pin
+    int threads[256];
+    int n_threads = rt_threads(threads, 256);
+    render_threads = render_pool_start(render_threads);
+    sync_init();
+    amy_start(render_threads,0,1,0);
+    amy_reset_oscs();
+    // Now that AMY has made its buffers, so they are locked and faulted in along with everything else
+    rt_lock_memory();
+    amy_global.latency_ms = ALLES_LATENCY_MS;
+    if(raw_file != NULL) return render_offline(raw_file, wav_file);
+    if(nodes > 1) {
+        alles_add_nodes(nodes);
+        printf("Running %d virtual synths, %d oscillators each\n", alles_node_count, me->osc_count);
+    }
+    // AMY's own callback renders on one thread, so splitting it needs our render thread
+    if(render_threads > 1 && ahead == 0) ahead = 2;
+    if(ahead == 0 || render_ahead_start(ahead) != 0) amy_live_start();
+    rt_audio_threads(threads, n_threads);
+    n_threads = rt_threads(threads, 256);
+    parse_workers_start(workers);
     create_multicast_ipv4_socket();
     pthread_t thread_id;
     pthread_create(&thread_id, NULL, mcast_listen_task, NULL);
+    rt_network_threads(threads, n_threads);
+    rt_started();
 
 #ifdef VIRTUAL_MIDI
     midi_init();
@@ -85,7 +248,9 @@ int main(int argc, char ** argv) {
     bleep(0);
     usleep(1000*1000);
     amy_reset_oscs();
+    rt_report();
     while(status & RUNNING) {
+        render_ahead_report();
         usleep(THREAD_USLEEP);
     }
 
@@ -22,6 +22,7 @@
 #include "esp_log.h"
 #include "esp_err.h"
 #include "esp_sleep.h"
+#include "esp_timer.h"
 #include "driver/uart.h"
 #include "nvs_flash.h"
 #include "lwip/netdb.h"
@@ -114,11 +115,16 @@ extern uint32_t event_counter;
 extern uint32_t message_counter;
 
 
+// How long each core took to render its part of the block, for alles_partition_measured
+uint32_t esp_part_us[2];
+
 // Render the second core
 void esp_render_task( void * pvParameters) {
     while(1) {
         ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
-        amy_render(0, AMY_OSCS/2, 1);
+        int64_t start = esp_timer_get_time();
+        amy_render(alles_partition.start[1], alles_partition.end[1], 1);
+        esp_part_us[1] = (uint32_t)(esp_timer_get_time() - start);
         xTaskNotifyGive(alles_fill_buffer_handle);
     }
 }
@@ -127,19 +133,27 @@ void esp_render_task( void * pvParameters) {
 void esp_fill_audio_buffer_task() {
     while(1) {
         AMY_PROFILE_START(AMY_ESP_FILL_BUFFER)
+        int64_t render_start = esp_timer_get_time();
+        // i2s_channel_write below paces this loop to the DAC, so blocks start a block's playing time apart
+        alles_block_start();
 
-        // Get ready to render
+        // Get ready to render, and split the oscillators that are playing between the cores
         amy_prepare_buffer();
+        alles_partition_plan();
         // Tell the other core to start rendering
         xTaskNotifyGive(amy_render_handle);
         // Render me
-        amy_render(AMY_OSCS/2, AMY_OSCS, 0);
+        int64_t part_start = esp_timer_get_time();
+        amy_render(alles_partition.start[0], alles_partition.end[0], 0);
+        esp_part_us[0] = (uint32_t)(esp_timer_get_time() - part_start);
         // Wait for the other core to finish
         ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        alles_partition_measured(esp_part_us);
 
         // Write to i2s
         int16_t *block = amy_fill_buffer();
         AMY_PROFILE_STOP(AMY_ESP_FILL_BUFFER)
+        alles_render_block((uint32_t)(esp_timer_get_time() - render_start));
 
         // We turn off writing to i2s on r10 when doing on chip debugging because of pins
         #ifndef TULIP_R10_DEBUG
@@ -167,6 +181,7 @@ void esp_parse_task() {
 // init AMY from the esp. wraps some amy funcs in a task to do multicore rendering on the ESP32 
 amy_err_t esp_amy_init() {
     amy_start(2, 0, 1, 0);
+    alles_partition_init(2);
     amy_global.latency_ms = ALLES_LATENCY_MS;
     // We create a mutex for changing the event queue and pointers as two tasks do it at once
     xQueueSemaphore = xSemaphoreCreateMutex();
@@ -222,8 +237,23 @@ void esp_show_debug(uint8_t type) {
         printf("%d %-15s\t%-15ld\t\t%2.2f%%\n", cores[i], tasks[i], counter_since_last[i], (float)counter_since_last[i]/ulTotalRunTime_per_core[cores[i]] * 100.0);
     }   
     printf("------\nEvent queue size %d / %d. Received %" PRIu32 " events and %" PRIu32 " messages\n", amy_global.event_qsize, AMY_EVENT_FIFO_LEN, event_counter, message_counter);
+    printf("Parse cache %" PRIu32 " hits %" PRIu32 " misses (%d entries, %d bytes)\n", parse_cache.hits, parse_cache.misses,
+        ALLES_PARSE_CACHE_ENTRIES, (int)sizeof(parse_cache));
+    printf("Latency %d ms, recommend %" PRIi32 " ms. %" PRIu32 " late events\n", amy_global.latency_ms, latency_recommend(), me->latency_stats.late);
+    if(alles_load.blocks) {
+        printf("Render %.1f%% of each block on average, %.1f%% at most. %" PRIu32 " events dropped with the queue full\n",
+            alles_load.render_us / (float)alles_load.blocks / (AMY_BLOCK_SIZE * 1000000.0f / AMY_SAMPLE_RATE) * 100.0f,
+            alles_load.peak_us / (AMY_BLOCK_SIZE * 1000000.0f / AMY_SAMPLE_RATE) * 100.0f, alles_load.dropped);
+    }
+    if(alles_load.split_blocks) {
+        printf("Slower core took %.1f%% longer than the average on average, %.1f%% at most. %d oscillators playing, split at %d\n",
+            alles_load.imbalance_sum / alles_load.split_blocks, alles_load.imbalance_peak, alles_partition.active_count, alles_partition.bounds[1]);
+    }
+    alles_print_senders();
     event_counter = 0;
     message_counter = 0;
+    parse_cache.hits = 0;
+    parse_cache.misses = 0;
     vPortFree(pxTaskStatusArray);
 
 }
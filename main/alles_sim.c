@@ -0,0 +1,455 @@
+// alles_sim.c
+// Deterministic mesh simulator. Runs hundreds of nodes' alles.c in one process, each with its own virtual clock
+// (AMY's clock is its sample count, so setting amy_global.total_samples moves it), talking over an in-process
+// network with configurable delay, jitter, loss and reordering. A simulated host syncs the mesh and plays a
+// note on every node every half second, and we measure how far apart in real time the nodes play each one.
+// Built by `make sim`. Run ./alles_sim -h for the knobs. The same seed gives the same run.
+#include "alles.h"
+#include <time.h>
+#include <unistd.h>
+
+// alles.c expects these from the multicast / platform files
+uint8_t battery_mask = 0;
+uint8_t ipv4_quartet = 0;
+uint32_t ipv4_address = 0;
+char githash[8];
+char *message_start_pointer;
+int16_t message_length;
+
+struct sim_node {
+    struct alles_node *node;
+    uint32_t addr;
+    int64_t boot_us;    // true time it comes up on the network
+    int64_t head_us;    // its clock then: AMY starts counting samples before WiFi is up, as on the ESP32
+    double rate;        // 1 + skew
+    int64_t wake_us;    // true time alles_poll next has something to do
+    int16_t last_id;
+    uint32_t id_changes; // after the mesh first converged
+    uint16_t most_alive; // most members it ever counted, more than sim_nodes is someone who isn't there
+};
+
+struct sim_packet {
+    int64_t due_us;
+    uint32_t seq;       // ties go in send order
+    int32_t dest;       // node index, -1 for the host
+    uint32_t from;
+    uint16_t len;
+    char *text;
+};
+
+// Knobs
+int sim_nodes = 64;
+float sim_skew_ppm = 50;     // each node's crystal is off by up to this either way
+float sim_delay_ms = 2;      // one way
+float sim_jitter_ms = 8;     // on top, uniformly
+float sim_loss = 0.01f;      // per packet per receiver
+float sim_reorder = 0.01f;   // packets held back an extra 1-4 jitters
+int sim_seconds = 300;
+int sim_boot_spread_s = 30;
+float sim_head_s = 8;         // AMY's clock runs up to this long before a node is on the network
+int sim_late_s = 0;           // if set, the node with the lowest address joins this long after the start
+float sim_max_spread_ms = 10; // worst play time spread we call a pass
+uint64_t sim_seed = 1;
+uint64_t sim_rng;
+FILE *report;
+
+struct sim_node *nodes;
+struct sim_packet *heap = NULL;
+uint32_t heap_len = 0, heap_cap = 0, heap_seq = 0;
+int64_t sim_now_us = 0;       // true time
+int32_t sim_current = -1;     // node we are running as, -1 for the host
+int64_t sim_note = -1;        // index of the host note being delivered
+uint32_t sent = 0, lost = 0;
+uint32_t host_addr = 0x01FF000a; // 10.0.255.1, in network order
+
+// Per note: the earliest and latest true time any node will play it, and how many did
+#define SIM_MAX_NOTES 100000
+int64_t *note_first, *note_last;
+uint16_t *note_count;
+uint8_t *note_voice; // sent g*, so exactly one node should play it
+uint32_t notes_sent = 0;
+
+static uint64_t sim_random() {
+    sim_rng ^= sim_rng << 13;
+    sim_rng ^= sim_rng >> 7;
+    sim_rng ^= sim_rng << 17;
+    return sim_rng;
+}
+
+static double sim_uniform() {
+    return (sim_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// A node's clock, and back
+static int64_t node_clock_us(struct sim_node *n, int64_t true_us) {
+    return n->head_us + (int64_t)((true_us - n->boot_us) * n->rate);
+}
+
+static int64_t node_true_us(struct sim_node *n, int64_t clock_us) {
+    return n->boot_us + (int64_t)((clock_us - n->head_us) / n->rate);
+}
+
+// alles.c is compiled with -DALLES_MONOTONIC_US=sim_monotonic_us, the current node's clock in us
+int64_t sim_monotonic_now_us = 0;
+int64_t sim_monotonic_us() {
+    return sim_monotonic_now_us;
+}
+
+// AMY's clock only moves a block at a time, and the renderer marks where each block started
+static void become(int32_t i) {
+    sim_current = i;
+    alles_node_select(nodes[i].node);
+    int64_t clock_us = node_clock_us(&nodes[i], sim_now_us);
+    int64_t samples = clock_us * AMY_SAMPLE_RATE / 1000000;
+    amy_global.total_samples = samples - samples % AMY_BLOCK_SIZE;
+    sim_monotonic_now_us = amy_global.total_samples * 1000000 / AMY_SAMPLE_RATE;
+    alles_block_start();
+    sim_monotonic_now_us = clock_us;
+}
+
+static void heap_push(struct sim_packet p) {
+    if(heap_len == heap_cap) {
+        heap_cap = heap_cap ? heap_cap * 2 : 1024;
+        heap = realloc(heap, heap_cap * sizeof(struct sim_packet));
+    }
+    p.seq = heap_seq++;
+    uint32_t i = heap_len++;
+    while(i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        struct sim_packet *q = &heap[parent];
+        if(q->due_us < p.due_us || (q->due_us == p.due_us && q->seq < p.seq)) break;
+        heap[i] = *q;
+        i = parent;
+    }
+    heap[i] = p;
+}
+
+static struct sim_packet heap_pop() {
+    struct sim_packet top = heap[0];
+    struct sim_packet last = heap[--heap_len];
+    uint32_t i = 0;
+    while(1) {
+        uint32_t c = i * 2 + 1;
+        if(c >= heap_len) break;
+        if(c + 1 < heap_len && (heap[c+1].due_us < heap[c].due_us || (heap[c+1].due_us == heap[c].due_us && heap[c+1].seq < heap[c].seq))) c++;
+        if(last.due_us < heap[c].due_us || (last.due_us == heap[c].due_us && last.seq < heap[c].seq)) break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = last;
+    return top;
+}
+
+static void sim_send_to(int32_t dest, uint32_t from, const char *message, uint16_t len) {
+    sent++;
+    if(sim_uniform() < sim_loss) {
+        lost++;
+        return;
+    }
+    struct sim_packet p;
+    double delay_ms = sim_delay_ms + sim_jitter_ms * sim_uniform();
+    if(sim_uniform() < sim_reorder) delay_ms += sim_jitter_ms * (1 + 3 * sim_uniform());
+    p.due_us = sim_now_us + (int64_t)(delay_ms * 1000);
+    p.dest = dest;
+    p.from = from;
+    p.len = len;
+    p.text = malloc(len + 1);
+    memcpy(p.text, message, len);
+    p.text[len] = 0;
+    heap_push(p);
+}
+
+static uint32_t sim_address(int32_t i) {
+    uint32_t addr;
+    uint8_t *a = (uint8_t *)&addr;
+    a[0] = 10; a[1] = 0; a[2] = i / 250; a[3] = i % 250 + 1;
+    return addr;
+}
+
+static int32_t sim_node_at(uint32_t addr) {
+    uint8_t *a = (uint8_t *)&addr;
+    if(a[0] != 10 || a[1] != 0 || a[3] == 0) return -1;
+    int32_t i = a[2] * 250 + a[3] - 1;
+    return i < sim_nodes ? i : -1;
+}
+
+// alles.c's network: multicast goes to every node that has booted
+void mcast_send(char * message, uint16_t len) {
+    uint32_t from = sim_current >= 0 ? nodes[sim_current].addr : host_addr;
+    for(int32_t i=0;i<sim_nodes;i++) {
+        if(i == sim_current || sim_now_us < nodes[i].boot_us) continue;
+        sim_send_to(i, from, message, len);
+    }
+}
+
+void udp_send(uint32_t addr, char * message, uint16_t len) {
+    int32_t i = sim_node_at(addr);
+    if(i >= 0 && sim_now_us >= nodes[i].boot_us) sim_send_to(i, nodes[sim_current].addr, message, len);
+}
+
+// alles.c is compiled with -DALLES_ADD_EVENT=sim_add_event for this build
+void sim_add_event(struct event e) {
+    if(sim_note < 0 || sim_current < 0) return;
+    int64_t play = node_true_us(&nodes[sim_current], (int64_t)e.time * 1000);
+    if(note_count[sim_note] == 0 || play < note_first[sim_note]) note_first[sim_note] = play;
+    if(note_count[sim_note] == 0 || play > note_last[sim_note]) note_last[sim_note] = play;
+    note_count[sim_note]++;
+}
+
+static void deliver(struct sim_packet *p) {
+    if(p->dest < 0) return; // replies to the host
+    become(p->dest);
+    message_sender = p->from;
+    // Notes are the only thing the host sends with a v
+    sim_note = -1;
+    char *tag = strchr(p->text, 'N');
+    if(p->text[0] == 't' && tag) sim_note = atoll(tag + 1);
+    uint16_t start = 0;
+    for(uint16_t i=0;i<p->len;i++) {
+        if(p->text[i] == 'Z') {
+            p->text[i] = 0;
+            alles_parse_message(p->text + start, i - start);
+            start = i + 1;
+        }
+    }
+    sim_note = -1;
+}
+
+static void wake(int32_t i) {
+    become(i);
+    alles_poll();
+    nodes[i].wake_us = sim_now_us + (int64_t)(alles_poll_wait_ms() * 1000 / nodes[i].rate) + 1;
+}
+
+// Every node has booted, sees all the others, and knows when each of them booted on the mesh clock. With a late
+// joiner, the rest of the mesh first; the joiner then mustn't change anyone else's client_id.
+static uint8_t converged() {
+    int32_t booted = 0;
+    for(int32_t i=0;i<sim_nodes;i++) if(sim_now_us >= nodes[i].boot_us) booted++;
+    if(booted < sim_nodes - (sim_late_s ? 1 : 0)) return 0;
+    for(int32_t i=0;i<sim_nodes;i++) {
+        if(sim_now_us < nodes[i].boot_us) continue;
+        if(nodes[i].node->alive != booted || nodes[i].node->members_stamped != booted) return 0;
+    }
+    return 1;
+}
+
+// Nodes that think they have the same client_id as another node. They'd all play the same g notes.
+static uint32_t duplicate_ids(uint8_t *seen) {
+    uint32_t duplicates = 0;
+    memset(seen, 0, sim_nodes);
+    for(int32_t i=0;i<sim_nodes;i++) {
+        int16_t id = nodes[i].node->client_id;
+        if(id < 0 || id >= sim_nodes) continue;
+        if(seen[id]++) duplicates++;
+    }
+    return duplicates;
+}
+
+static int cmp_i64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int sim_run() {
+    const float host_skew_ppm = 30;
+    nodes = calloc(sim_nodes, sizeof(struct sim_node));
+    note_first = calloc(SIM_MAX_NOTES, sizeof(int64_t));
+    note_last = calloc(SIM_MAX_NOTES, sizeof(int64_t));
+    note_count = calloc(SIM_MAX_NOTES, sizeof(uint16_t));
+    note_voice = calloc(SIM_MAX_NOTES, 1);
+    uint8_t *seen = calloc(sim_nodes, 1);
+    // Mix the seed's bits (splitmix64) so small seeds don't start xorshift off nearly all zeros
+    uint64_t z = sim_seed + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    sim_rng = z ^ (z >> 31);
+    sync_init();
+    amy_start(1,0,0,0);
+    amy_global.latency_ms = ALLES_LATENCY_MS;
+    for(int32_t i=0;i<sim_nodes;i++) {
+        struct sim_node *n = &nodes[i];
+        n->addr = sim_address(i);
+        n->node = alles_node_new(n->addr, i % 250 + 1);
+        if(n->node == NULL) {
+            fprintf(stderr, "sim: can't make node %d\n", i);
+            return 1;
+        }
+        n->boot_us = (int64_t)(sim_uniform() * sim_boot_spread_s * 1000000);
+        if(sim_late_s && i == 0) n->boot_us = (int64_t)sim_late_s * 1000000;
+        n->head_us = (int64_t)(sim_uniform() * sim_head_s * 1000000);
+        n->rate = 1.0 + sim_skew_ppm * (2 * sim_uniform() - 1) / 1e6;
+        n->wake_us = n->boot_us;
+        n->last_id = -1;
+    }
+    // The host: its own clock, sync()s everyone every minute and plays a note for all every half second.
+    // Every other minute it asks for the replies to come back through the master, like aggregate=True.
+    int64_t host_clock0_us = 12345678;
+    double host_rate = 1.0 + host_skew_ppm / 1e6;
+    int64_t next_sync_us = (sim_boot_spread_s + 5) * 1000000LL, next_note_us = next_sync_us + 2000000;
+    uint8_t sync_sent = 0;
+    uint32_t sync_index = 0;
+
+    int64_t end_us = (int64_t)sim_seconds * 1000000;
+    int64_t converged_us = -1, next_check_us = 0;
+    uint32_t measure_from = 0;
+    clock_t started = clock();
+    while(sim_now_us < end_us) {
+        // Whatever comes first: a packet, a node's poll, the host, or our 100 ms check
+        int64_t next = next_check_us;
+        if(heap_len && heap[0].due_us < next) next = heap[0].due_us;
+        if(next_sync_us < next) next = next_sync_us;
+        if(next_note_us < next) next = next_note_us;
+        int32_t waking = -1;
+        for(int32_t i=0;i<sim_nodes;i++) {
+            if(nodes[i].wake_us < next) {
+                next = nodes[i].wake_us;
+                waking = i;
+            }
+        }
+        sim_now_us = next;
+        if(waking >= 0) {
+            wake(waking);
+        } else if(heap_len && heap[0].due_us == next) {
+            struct sim_packet p = heap_pop();
+            deliver(&p);
+            free(p.text);
+            // A sync request may have left a reply to send
+            if(p.dest >= 0) wake(p.dest);
+        } else if(next == next_sync_us) {
+            int64_t host_us = host_clock0_us + (int64_t)(sim_now_us * host_rate);
+            char message[64];
+            sim_current = -1;
+            int len = sprintf(message, "U%lld.%03di%dw200%sZ", (long long)(host_us / 1000), (int)(host_us % 1000), sync_index++ % 100,
+                (sync_sent / 10) % 2 ? "x1" : "");
+            mcast_send(message, len);
+            sync_sent++;
+            // Ten requests 100 ms apart, then again in a minute
+            next_sync_us += (sync_sent % 10) ? 100000 : 60000000 - 900000;
+        } else if(next == next_note_us) {
+            int64_t host_us = host_clock0_us + (int64_t)(sim_now_us * host_rate);
+            char message[64];
+            sim_current = -1;
+            if(notes_sent < SIM_MAX_NOTES) {
+                // N is a tag for us, AMY ignores it. Every fourth note is left to the mesh to place.
+                note_voice[notes_sent] = (notes_sent % 4 == 3);
+                int len = sprintf(message, "t%lld.%03dv%dn60l1%sN%dZ", (long long)(host_us / 1000), (int)(host_us % 1000),
+                    note_voice[notes_sent], note_voice[notes_sent] ? "g*" : "", notes_sent);
+                notes_sent++;
+                mcast_send(message, len);
+            }
+            next_note_us += 500000;
+        } else {
+            if(converged_us < 0 && converged()) {
+                converged_us = sim_now_us;
+                for(int32_t i=0;i<sim_nodes;i++) nodes[i].last_id = nodes[i].node->client_id;
+            } else if(converged_us >= 0) {
+                for(int32_t i=0;i<sim_nodes;i++) {
+                    if(nodes[i].boot_us > converged_us) continue; // the late joiner finds its place
+                    if(nodes[i].node->client_id != nodes[i].last_id) {
+                        nodes[i].id_changes++;
+                        nodes[i].last_id = nodes[i].node->client_id;
+                    }
+                }
+            }
+            for(int32_t i=0;i<sim_nodes;i++) if(nodes[i].node->alive > nodes[i].most_alive) nodes[i].most_alive = nodes[i].node->alive;
+            if(measure_from == 0 && sim_now_us >= end_us / 2) measure_from = notes_sent;
+            next_check_us += 100000;
+        }
+    }
+    double wall_s = (double)(clock() - started) / CLOCKS_PER_SEC;
+
+    // Sync error: how far apart the first and last node played each note, over the second half of the run.
+    // g* notes should have been played by one node each.
+    uint32_t measured = 0, incomplete = 0, voices = 0, voices_doubled = 0, voices_dropped = 0;
+    int64_t *spread = calloc(notes_sent + 1, sizeof(int64_t));
+    for(uint32_t i=measure_from;i<notes_sent;i++) {
+        if(note_voice[i]) {
+            voices++;
+            if(note_count[i] > 1) voices_doubled++;
+            if(note_count[i] == 0) voices_dropped++;
+            continue;
+        }
+        if(note_count[i] == 0) continue;
+        if(note_count[i] < sim_nodes) incomplete++;
+        spread[measured++] = note_last[i] - note_first[i];
+    }
+    qsort(spread, measured, sizeof(int64_t), cmp_i64);
+    uint32_t changes = 0, changed_nodes = 0, crowded = 0;
+    for(int32_t i=0;i<sim_nodes;i++) {
+        changes += nodes[i].id_changes;
+        if(nodes[i].id_changes) changed_nodes++;
+        if(nodes[i].most_alive > sim_nodes) crowded++;
+    }
+    uint32_t duplicates = duplicate_ids(seen);
+    // A late joiner booted last, so it should be the youngest whatever its address
+    uint8_t late_ok = !sim_late_s || nodes[0].node->client_id == sim_nodes - 1;
+    uint8_t ok = (converged_us >= 0 && late_ok && changes == 0 && duplicates == 0 && crowded == 0 && voices_doubled == 0 && measured > 0 && spread[measured - 1] <= sim_max_spread_ms * 1000);
+    fprintf(report, "sim: %d nodes, %d s (%.1f s to run), skew +-%.0f ppm, delay %.1f+%.1f ms, %.1f%% loss, %.1f%% reordered, seed %llu\n",
+        sim_nodes, sim_seconds, wall_s, sim_skew_ppm, sim_delay_ms, sim_jitter_ms, sim_loss * 100, sim_reorder * 100, (unsigned long long)sim_seed);
+    fprintf(report, "sim: %" PRIu32 " packets, %" PRIu32 " lost\n", sent, lost);
+    if(converged_us >= 0) {
+        int64_t last_boot_us = 0;
+        for(int32_t i=0;i<sim_nodes;i++) if(nodes[i].boot_us > last_boot_us && nodes[i].boot_us <= converged_us) last_boot_us = nodes[i].boot_us;
+        fprintf(report, "sim: everyone saw everyone %.2f s after the last boot\n", (converged_us - last_boot_us) / 1e6);
+    } else {
+        fprintf(report, "sim: membership never converged\n");
+    }
+    fprintf(report, "sim: %" PRIu32 " client_id changes on %" PRIu32 " nodes after converging, %" PRIu32 " nodes sharing a client_id at the end\n",
+        changes, changed_nodes, duplicates);
+    if(sim_late_s) fprintf(report, "sim: the late joiner with the lowest address has client_id %d, should be %d\n", nodes[0].node->client_id, sim_nodes - 1);
+    if(crowded) fprintf(report, "sim: %" PRIu32 " nodes counted members that aren't there\n", crowded);
+    if(measured) {
+        fprintf(report, "sim: %" PRIu32 " notes measured (%" PRIu32 " missed somewhere), play time spread median %.3f ms, p99 %.3f ms, worst %.3f ms\n",
+            measured, incomplete, spread[measured / 2] / 1000.0, spread[measured * 99 / 100] / 1000.0, spread[measured - 1] / 1000.0);
+    }
+    if(voices) {
+        fprintf(report, "sim: %" PRIu32 " g* notes, %" PRIu32 " played more than once, %" PRIu32 " not at all\n",
+            voices, voices_doubled, voices_dropped);
+    }
+    fprintf(report, "sim: %s\n", ok ? "ok" : "FAIL");
+    free(spread);
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char ** argv) {
+    int opt;
+    uint8_t verbose = 0;
+    while((opt = getopt(argc, argv, "n:s:d:j:l:r:t:b:w:J:e:S:vh")) != -1) {
+        switch(opt) {
+            case 'n': sim_nodes = atoi(optarg); break;
+            case 's': sim_skew_ppm = atof(optarg); break;
+            case 'd': sim_delay_ms = atof(optarg); break;
+            case 'j': sim_jitter_ms = atof(optarg); break;
+            case 'l': sim_loss = atof(optarg) / 100.0f; break;
+            case 'r': sim_reorder = atof(optarg) / 100.0f; break;
+            case 't': sim_seconds = atoi(optarg); break;
+            case 'b': sim_boot_spread_s = atoi(optarg); break;
+            case 'w': sim_head_s = atof(optarg); break;
+            case 'J': sim_late_s = atoi(optarg); break;
+            case 'e': sim_max_spread_ms = atof(optarg); break;
+            case 'S': sim_seed = strtoull(optarg, NULL, 10); break;
+            case 'v': verbose = 1; break;
+            default:
+                printf("usage: alles_sim\n\t[-n nodes, default 64]\n\t[-s clock skew, +- ppm, default 50]\n");
+                printf("\t[-d one way delay ms, default 2]\n\t[-j jitter ms on top, default 8]\n\t[-l loss %%, default 1]\n");
+                printf("\t[-r reordered %%, default 1]\n\t[-t seconds to run, default 300]\n\t[-b seconds the nodes boot over, default 30]\n");
+                printf("\t[-w most seconds AMY runs before a node is on the network, default 8]\n");
+                printf("\t[-J seconds after the start the lowest addressed node joins, default with the rest]\n");
+                printf("\t[-e worst play time spread in ms that passes, default 10]\n");
+                printf("\t[-S seed, default 1]\n\t[-v show what the nodes print]\n");
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(sim_nodes < 1 || sim_nodes > 2500) sim_nodes = 64;
+    if(sim_seed == 0) sim_seed = 1;
+    // The nodes are chatty. Keep our report and drop theirs.
+    report = fdopen(dup(1), "w");
+    if(!verbose) {
+        freopen("/dev/null", "w", stdout);
+        freopen("/dev/null", "w", stderr);
+    }
+    int result = sim_run();
+    fclose(report);
+    return result;
+}
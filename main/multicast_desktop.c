@@ -15,17 +15,22 @@
 #include <netdb.h>
 
 extern void deserialize_event(char * message, uint16_t length);
-extern void ping(int64_t sysclock);
+extern uint8_t parse_workers;
+extern int16_t parse_workers_acquire();
+extern char *parse_workers_buffer(int16_t slot);
+extern void parse_workers_submit(int16_t slot, int16_t length, struct sockaddr_in *from);
+extern void parse_workers_lock();
+extern void parse_workers_unlock();
 
 int sock= -1;
 uint8_t ipv4_quartet;
+uint32_t ipv4_address; // our full address, in network order
 extern uint8_t quartet_offset;
 char udp_message[MAX_RECEIVE_LEN];
 extern char *message_start_pointer;
 extern char *local_ip;
 extern int16_t message_length;
 uint32_t udp_message_counter = 0;
-int64_t last_ping_time = PING_TIME_MS; // do the first ping at 10s in to wait for other synths to announce themselves
 
 
 // Gets the first non-localhost IP address if the user did not specify one on the commandline.
@@ -67,6 +72,8 @@ int socket_add_ipv4_multicast_group() {
 
     // Get the ipv4 "quartet" (last # of 4) and add the offset to it if one
     ipv4_quartet = ((iaddr.s_addr & 0xFF000000) >> 24) + quartet_offset;
+    ipv4_address = iaddr.s_addr;
+    alles_set_address(ipv4_address, ipv4_quartet);
 
     // Assign the IPv4 multicast source interface, via its IP
     err = setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &iaddr,
@@ -141,6 +148,7 @@ void create_multicast_ipv4_socket(void) {
 
 
 void mcast_send(char * message, uint16_t len) {
+    if(sock < 0) return; // rendering offline, no network
     struct addrinfo hints = {
         .ai_flags = AI_PASSIVE,
         .ai_socktype = SOCK_DGRAM,
@@ -163,13 +171,22 @@ void mcast_send(char * message, uint16_t len) {
 }
 
 
+// Send straight to one node, on the same port
+void udp_send(uint32_t addr, char * message, uint16_t len) {
+    if(sock < 0) return; // rendering offline, no network
+    struct sockaddr_in daddr = { 0 };
+    daddr.sin_family = AF_INET;
+    daddr.sin_port = htons(UDP_PORT);
+    daddr.sin_addr.s_addr = addr;
+    int err = sendto(sock, message, len, 0, (struct sockaddr *)&daddr, sizeof(daddr));
+    if (err < 0) {
+        fprintf(stderr, "IPV4 unicast sendto failed. errno: %d", errno);
+    }
+}
 
 // called from pthread
 void *mcast_listen_task(void *vargp) {
-    struct timeval tv = {
-        .tv_sec =  1,
-        .tv_usec = 0,
-    };
+    struct timeval tv;
 
     int16_t full_message_length;
     while (1) {
@@ -183,9 +200,14 @@ void *mcast_listen_task(void *vargp) {
 
         int err = 1;
         while (err > 0) { 
+            uint8_t received = 0;
             fd_set rfds;
             FD_ZERO(&rfds);
             FD_SET(sock, &rfds);
+            // Wake up in time for whatever alles_poll has to do next
+            int32_t wait_ms = alles_poll_wait_ms();
+            tv.tv_sec = wait_ms / 1000;
+            tv.tv_usec = (wait_ms % 1000) * 1000;
 
             int s = select(sock + 1, &rfds, NULL, NULL, &tv);
             if (s < 0) {
@@ -199,34 +221,53 @@ void *mcast_listen_task(void *vargp) {
                     // Turn on the CPU monitor to see how long parsing takes
                     struct sockaddr_in6 raddr; // Large enough for both IPv4 or IPv6
                     socklen_t socklen = sizeof(raddr);
-                    full_message_length = recvfrom(sock, udp_message, sizeof(udp_message)-1, 0,
-                                       (struct sockaddr *)&raddr, &socklen);
-                    if (full_message_length < 0) {
-                        fprintf(stderr, "multicast recvfrom failed: errno %d\n", errno);
-                        err = -1;
-                        break;
-                    }
-                    udp_message[full_message_length] = 0;
-                    uint16_t start = 0;
-                    // Break the packet up into messages (delimited by Z.)
-                    for(uint16_t i=0;i<full_message_length;i++) {
-                        if(udp_message[i] == 'Z') {
-                            udp_message[i] = 0;
-                            udp_message_counter++;
-                            message_start_pointer = udp_message + start;
-                            message_length = i - start;
-                            alles_parse_message(message_start_pointer, message_length);
-                            start = i+1;
+                    if(parse_workers) {
+                        // Receive straight into the workers' arena and let them split and parse it
+                        int16_t slot = parse_workers_acquire();
+                        full_message_length = recvfrom(sock, parse_workers_buffer(slot), MAX_RECEIVE_LEN-1, 0,
+                                           (struct sockaddr *)&raddr, &socklen);
+                        if (full_message_length < 0) {
+                            fprintf(stderr, "multicast recvfrom failed: errno %d\n", errno);
+                            parse_workers_submit(slot, 0, (struct sockaddr_in *)&raddr);
+                            err = -1;
+                            break;
+                        }
+                        parse_workers_buffer(slot)[full_message_length] = 0;
+                        parse_workers_submit(slot, full_message_length, (struct sockaddr_in *)&raddr);
+                        received = 1;
+                    } else {
+                        full_message_length = recvfrom(sock, udp_message, sizeof(udp_message)-1, 0,
+                                           (struct sockaddr *)&raddr, &socklen);
+                        if (full_message_length < 0) {
+                            fprintf(stderr, "multicast recvfrom failed: errno %d\n", errno);
+                            err = -1;
+                            break;
+                        }
+                        udp_message[full_message_length] = 0;
+                        message_sender = ((struct sockaddr_in *)&raddr)->sin_addr.s_addr;
+                        uint16_t start = 0;
+                        // Break the packet up into messages (delimited by Z.)
+                        for(uint16_t i=0;i<full_message_length;i++) {
+                            if(udp_message[i] == 'Z') {
+                                udp_message[i] = 0;
+                                udp_message_counter++;
+                                message_start_pointer = udp_message + start;
+                                message_length = i - start;
+                                alles_parse_message(message_start_pointer, message_length);
+                                start = i+1;
+                            }
                         }
                     }
                 }
             } 
-            // Do a ping every so often
-            int64_t sysclock = amy_sysclock();
-            if(sysclock > (last_ping_time+PING_TIME_MS)) {
-                ping(sysclock);
+            // Ping when it's due, and beacon if we're the time master
+            if(alles_poll_wait_ms() == 0) {
+                parse_workers_lock();
+                alles_poll();
+                parse_workers_unlock();
             }
-            usleep(THREAD_USLEEP);
+            // With parse workers the listener only receives, so go straight back for the next datagram
+            if(!received) usleep(THREAD_USLEEP);
         }
 
         fprintf(stderr, "Shutting down socket and restarting...\n");
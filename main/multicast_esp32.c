@@ -4,7 +4,6 @@
 #include <stddef.h>
 #include <math.h>
 
-#include <esp_timer.h>
 
 #include "alles.h"
 
@@ -20,6 +19,7 @@ extern uint8_t battery_mask;
 extern TaskHandle_t parseTask;
 
 uint8_t ipv4_quartet;
+uint32_t ipv4_address; // our full address, in network order
 
 char udp_message[MAX_RECEIVE_LEN];
 
@@ -34,7 +34,6 @@ uint32_t udp_message_counter = 0;
 
 
 
-int64_t last_ping_time = PING_TIME_MS; // do the first ping at 10s in to wait for other synths to announce themselves
 
 static int socket_add_ipv4_multicast_group(bool assign_source_if) {
     struct ip_mreq imreq = { 0 };
@@ -154,14 +153,24 @@ void mcast_send(char * message, uint16_t len) {
 }
 
 
+// Send straight to one node, on the same port
+void udp_send(uint32_t addr, char * message, uint16_t len) {
+    struct sockaddr_in daddr = { 0 };
+    daddr.sin_family = AF_INET;
+    daddr.sin_port = htons(UDP_PORT);
+    daddr.sin_addr.s_addr = addr;
+    int err = sendto(sock, message, len, 0, (struct sockaddr *)&daddr, sizeof(daddr));
+    if (err < 0) {
+        ESP_LOGE(TAG, "IPV4 unicast sendto failed. errno: %d", errno);
+    }
+}
 
 void mcast_listen_task(void *pvParameters) {
-    struct timeval tv = {
-        .tv_sec =  1,
-        .tv_usec = 0,
-    };
+    struct timeval tv;
     
     ipv4_quartet = esp_ip4_addr4(&wifi_manager_ip4);
+    ipv4_address = wifi_manager_ip4.addr;
+    alles_set_address(ipv4_address, ipv4_quartet);
     int16_t full_message_length;
     printf("Network listening running on core %d\n",xPortGetCoreID());
     while (1) {
@@ -180,6 +189,10 @@ void mcast_listen_task(void *pvParameters) {
             fd_set rfds;
             FD_ZERO(&rfds);
             FD_SET(sock, &rfds);
+            // Wake up in time for whatever alles_poll has to do next
+            int32_t wait_ms = alles_poll_wait_ms();
+            tv.tv_sec = wait_ms / 1000;
+            tv.tv_usec = (wait_ms % 1000) * 1000;
 
             int s = select(sock + 1, &rfds, NULL, NULL, &tv);
             if (s < 0) {
@@ -200,6 +213,7 @@ void mcast_listen_task(void *pvParameters) {
                         break;
                     }
                     udp_message[full_message_length] = 0;
+                    message_sender = ((struct sockaddr_in *)&raddr)->sin_addr.s_addr;
                     //fprintf(stderr, "###%s###\n", udp_message);
                     uint16_t start = 0;
                     // Break the packet up into messages (delimited by Z.)
@@ -218,11 +232,8 @@ void mcast_listen_task(void *pvParameters) {
                     }
                 }
             }
-            // Do a ping every so often
-            int64_t sysclock = esp_timer_get_time() / 1000;
-            if(sysclock > (last_ping_time+PING_TIME_MS)) {
-                ping(sysclock);
-            }
+            // Ping when it's due, and beacon if we're the time master
+            alles_poll();
         }
 
         ESP_LOGE(TAG, "Shutting down socket and restarting...");
@@ -0,0 +1,146 @@
+// parse_desktop.c
+// Parse worker pool for the desktop build. The listener receives each datagram straight into a slot of a
+// shared receive arena and hands the slot to a worker; the worker splits it into messages in place, decodes
+// them with its own parse cache and then applies them (map updates, syncs, amy_add_event) under one lock.
+// Messages AMY may act on while parsing (resets, effects, volume...) aren't decoded by the workers at all;
+// they're handed over whole and parsed as they're applied, under the lock.
+// A sender's datagrams always go to the same worker and each worker takes its slots in arrival order,
+// so every sender's messages reach AMY's queue in the order they were sent.
+#include "alles.h"
+#include <pthread.h>
+#include <netinet/in.h>
+
+#define PARSE_SLOTS 64         // datagrams in flight between the listener and the workers
+#define PARSE_MAX_WORKERS 16
+#define PARSE_BATCH 16         // messages decoded before taking the apply lock
+
+struct parse_slot {
+    char data[MAX_RECEIVE_LEN];
+    int16_t length;
+    int64_t received_us;
+    uint32_t addr;
+};
+
+struct parse_worker {
+    pthread_t thread;
+    pthread_cond_t ready;
+    uint16_t queue[PARSE_SLOTS];
+    uint16_t head;
+    uint16_t count;
+    struct parse_cache cache;
+};
+
+uint8_t parse_workers = 0; // 0 parses on the listener thread, as before
+extern uint32_t udp_message_counter;
+
+struct parse_slot parse_arena[PARSE_SLOTS];
+uint16_t parse_free[PARSE_SLOTS];
+uint16_t parse_free_count = 0;
+struct parse_worker *parse_worker_pool = NULL;
+
+pthread_mutex_t parse_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t parse_slot_free = PTHREAD_COND_INITIALIZER;
+// Held while anything touches the map, the sender table or AMY's queue from the network side
+pthread_mutex_t alles_apply_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void parse_workers_lock() {
+    if(parse_workers) pthread_mutex_lock(&alles_apply_lock);
+}
+
+void parse_workers_unlock() {
+    if(parse_workers) pthread_mutex_unlock(&alles_apply_lock);
+}
+
+static void parse_release_slot(uint16_t slot) {
+    pthread_mutex_lock(&parse_queue_lock);
+    parse_free[parse_free_count++] = slot;
+    pthread_cond_signal(&parse_slot_free);
+    pthread_mutex_unlock(&parse_queue_lock);
+}
+
+static void parse_apply_batch(struct alles_message *batch, uint16_t n) {
+    pthread_mutex_lock(&alles_apply_lock);
+    for(uint16_t i=0;i<n;i++) {
+        udp_message_counter++;
+        alles_apply_message(&batch[i]);
+    }
+    pthread_mutex_unlock(&alles_apply_lock);
+}
+
+static void *parse_worker_task(void *vargp) {
+    struct parse_worker *w = (struct parse_worker *)vargp;
+    struct alles_message batch[PARSE_BATCH];
+    while(1) {
+        pthread_mutex_lock(&parse_queue_lock);
+        while(w->count == 0) pthread_cond_wait(&w->ready, &parse_queue_lock);
+        uint16_t slot = w->queue[w->head];
+        w->head = (w->head + 1) % PARSE_SLOTS;
+        w->count--;
+        pthread_mutex_unlock(&parse_queue_lock);
+
+        struct parse_slot *p = &parse_arena[slot];
+        uint16_t start = 0;
+        uint16_t n = 0;
+        // Break the packet up into messages (delimited by Z.)
+        for(uint16_t i=0;i<p->length;i++) {
+            if(p->data[i] == 'Z') {
+                p->data[i] = 0;
+                alles_decode_message(p->data + start, i - start, p->received_us, p->addr, &w->cache, &batch[n++]);
+                if(n == PARSE_BATCH) {
+                    parse_apply_batch(batch, n);
+                    n = 0;
+                }
+                start = i+1;
+            }
+        }
+        if(n) parse_apply_batch(batch, n);
+        parse_release_slot(slot);
+    }
+    return NULL;
+}
+
+void parse_workers_start(uint8_t n) {
+    if(n > PARSE_MAX_WORKERS) n = PARSE_MAX_WORKERS;
+    if(n == 0) return;
+    parse_worker_pool = (struct parse_worker *)malloc(sizeof(struct parse_worker) * n);
+    for(uint16_t i=0;i<PARSE_SLOTS;i++) parse_free[i] = i;
+    parse_free_count = PARSE_SLOTS;
+    for(uint8_t i=0;i<n;i++) {
+        struct parse_worker *w = &parse_worker_pool[i];
+        pthread_cond_init(&w->ready, NULL);
+        w->head = 0;
+        w->count = 0;
+        parse_cache_init(&w->cache);
+        pthread_create(&w->thread, NULL, parse_worker_task, w);
+    }
+    parse_workers = n;
+    printf("Parsing on %d worker threads\n", n);
+}
+
+// Get an empty arena slot to receive into. Blocks if the workers are this far behind.
+int16_t parse_workers_acquire() {
+    pthread_mutex_lock(&parse_queue_lock);
+    while(parse_free_count == 0) pthread_cond_wait(&parse_slot_free, &parse_queue_lock);
+    int16_t slot = parse_free[--parse_free_count];
+    pthread_mutex_unlock(&parse_queue_lock);
+    return slot;
+}
+
+char *parse_workers_buffer(int16_t slot) {
+    return parse_arena[slot].data;
+}
+
+// Hand a received datagram to the worker that owns its sender
+void parse_workers_submit(int16_t slot, int16_t length, struct sockaddr_in *from) {
+    struct parse_slot *p = &parse_arena[slot];
+    p->length = length;
+    p->received_us = alles_sysclock_us();
+    p->addr = from->sin_addr.s_addr;
+    uint32_t sender = (uint32_t)from->sin_addr.s_addr ^ ((uint32_t)from->sin_port << 16);
+    struct parse_worker *w = &parse_worker_pool[(sender * 2654435761u) % parse_workers];
+    pthread_mutex_lock(&parse_queue_lock);
+    w->queue[(w->head + w->count) % PARSE_SLOTS] = slot;
+    w->count++;
+    pthread_cond_signal(&w->ready);
+    pthread_mutex_unlock(&parse_queue_lock);
+}
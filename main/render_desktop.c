@@ -0,0 +1,254 @@
+// render_desktop.c
+// Render-ahead for the desktop build. Normally AMY renders inside miniaudio's device callback
+// (amy/src/libminiaudio-audio.c), so one slow block is one glitch. With -a N a thread of our own renders
+// up to N blocks ahead into a single producer / single consumer ring and our callback only copies them out,
+// so a render can take longer than a block now and then as long as the ring has some in hand.
+// It costs N blocks of extra output latency. miniaudio itself is compiled into AMY's libminiaudio-audio.c.
+// With -t N each block is also split across N threads, the way the ESP32 splits it across its two cores:
+// thread k renders its share of the oscillators into AMY's block buffer for core k and amy_fill_buffer mixes them.
+// alles_partition (in alles.c, shared with the ESP32) decides each block's shares from what's playing, and
+// with one thread or several only the stretch of oscillators that are actually playing gets rendered.
+#include "alles.h"
+#include "miniaudio.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RENDER_RING_BLOCKS 32   // most blocks we can be ahead, plus one
+#define RENDER_REPORT_MS 10000  // how often to say how the ring is doing, if anything went wrong
+// AMY keeps one block buffer per core it was started with, so that's as many threads as can render at once
+#ifdef AMY_CORES
+#define RENDER_MAX_THREADS AMY_CORES
+#else
+#define RENDER_MAX_THREADS 2
+#endif
+
+extern int16_t amy_playback_device_id;
+extern uint8_t status;
+
+struct render_block {
+    int16_t samples[AMY_BLOCK_SIZE * AMY_NCHANS];
+};
+
+uint8_t render_ahead = 0; // 0 leaves rendering to AMY's own callback
+struct render_block render_ring[RENDER_RING_BLOCKS];
+_Atomic uint32_t render_head = 0; // blocks rendered, only the render thread writes it
+_Atomic uint32_t render_tail = 0; // blocks played, only the callback writes it
+uint16_t render_offset = 0;       // frames of the tail block already played, callback only
+
+// Stats, each written by one side and read by the reporter
+_Atomic uint32_t render_underruns = 0;   // callbacks that ran out of blocks
+_Atomic uint32_t render_fewest = RENDER_RING_BLOCKS; // fewest blocks ready at a callback since the last report
+uint32_t render_peak_us = 0;             // longest block since the last report
+
+// One per render thread, each on its own cache lines so finishing one doesn't slow the others
+struct render_worker {
+    pthread_t thread;
+    uint8_t core;    // renders alles_partition's part of the same number
+    uint32_t us;     // how long that took this block
+} __attribute__((aligned(64)));
+
+uint8_t render_threads = 1;
+struct render_worker render_workers[RENDER_MAX_THREADS];
+pthread_mutex_t render_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t render_go = PTHREAD_COND_INITIALIZER;
+pthread_cond_t render_done = PTHREAD_COND_INITIALIZER;
+uint32_t render_generation = 0; // bumped once per block to set the workers going
+uint8_t render_pending = 0;     // workers still rendering this block
+
+ma_context render_context;
+ma_device render_device;
+pthread_t render_thread;
+
+static uint32_t render_block_us() {
+    return (uint32_t)((uint64_t)AMY_BLOCK_SIZE * 1000000 / AMY_SAMPLE_RATE);
+}
+
+static uint32_t render_part(uint8_t core) {
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    amy_render(alles_partition.start[core], alles_partition.end[core], core);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    return (uint32_t)((stop.tv_sec - start.tv_sec) * 1000000 + (stop.tv_nsec - start.tv_nsec) / 1000);
+}
+
+static void *render_worker_task(void *vargp) {
+    struct render_worker *w = (struct render_worker *)vargp;
+    uint32_t done = 0;
+    while(1) {
+        pthread_mutex_lock(&render_pool_lock);
+        while(render_generation == done) pthread_cond_wait(&render_go, &render_pool_lock);
+        done = render_generation;
+        pthread_mutex_unlock(&render_pool_lock);
+        w->us = render_part(w->core);
+        pthread_mutex_lock(&render_pool_lock);
+        if(--render_pending == 0) pthread_cond_signal(&render_done);
+        pthread_mutex_unlock(&render_pool_lock);
+    }
+    return NULL;
+}
+
+// Start a thread for every part of the block but the first, which the caller renders.
+// Call before amy_start, which needs to know how many block buffers to mix.
+uint8_t render_pool_start(uint8_t threads) {
+    if(threads < 1) threads = 1;
+    if(threads > RENDER_MAX_THREADS) {
+        fprintf(stderr, "AMY can only mix %d render threads\n", RENDER_MAX_THREADS);
+        threads = RENDER_MAX_THREADS;
+    }
+    render_threads = threads;
+    alles_partition_init(threads);
+    for(uint8_t i=0;i<threads;i++) {
+        struct render_worker *w = &render_workers[i];
+        w->core = i;
+        if(i) pthread_create(&w->thread, NULL, render_worker_task, w);
+    }
+    if(threads > 1) printf("Rendering on %d threads\n", threads);
+    return threads;
+}
+
+// One block: every thread renders its oscillators, then AMY mixes them
+int16_t *render_block() {
+    alles_block_start();
+    amy_prepare_buffer();
+    alles_partition_plan();
+    if(render_threads == 1) {
+        amy_render(alles_partition.start[0], alles_partition.end[0], 0);
+        return amy_fill_buffer();
+    }
+    pthread_mutex_lock(&render_pool_lock);
+    render_pending = render_threads - 1;
+    render_generation++;
+    pthread_cond_broadcast(&render_go);
+    pthread_mutex_unlock(&render_pool_lock);
+    render_workers[0].us = render_part(0);
+    pthread_mutex_lock(&render_pool_lock);
+    while(render_pending) pthread_cond_wait(&render_done, &render_pool_lock);
+    pthread_mutex_unlock(&render_pool_lock);
+    uint32_t us[RENDER_MAX_THREADS];
+    for(uint8_t i=0;i<render_threads;i++) us[i] = render_workers[i].us;
+    alles_partition_measured(us);
+    return amy_fill_buffer();
+}
+
+static void *render_task(void *vargp) {
+    uint32_t sleep_us = render_block_us() / 4;
+    while(status & RUNNING) {
+        uint32_t head = atomic_load_explicit(&render_head, memory_order_relaxed);
+        uint32_t tail = atomic_load_explicit(&render_tail, memory_order_acquire);
+        if(head - tail >= render_ahead) {
+            usleep(sleep_us);
+            continue;
+        }
+        struct timespec start, stop;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int16_t *block = render_block();
+        memcpy(render_ring[head % RENDER_RING_BLOCKS].samples, block, sizeof(struct render_block));
+        atomic_store_explicit(&render_head, head + 1, memory_order_release);
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        uint32_t us = (uint32_t)((stop.tv_sec - start.tv_sec) * 1000000 + (stop.tv_nsec - start.tv_nsec) / 1000);
+        alles_render_block(us);
+        if(us > render_peak_us) render_peak_us = us;
+    }
+    return NULL;
+}
+
+// miniaudio asks for whatever number of frames suits the device, which needn't be a whole block
+static void render_callback(ma_device *device, void *output, const void *input, ma_uint32 frames) {
+    int16_t *out = (int16_t *)output;
+    uint32_t tail = atomic_load_explicit(&render_tail, memory_order_relaxed);
+    uint32_t ready = atomic_load_explicit(&render_head, memory_order_acquire) - tail;
+    if(ready < atomic_load_explicit(&render_fewest, memory_order_relaxed)) atomic_store_explicit(&render_fewest, ready, memory_order_relaxed);
+    while(frames) {
+        if(atomic_load_explicit(&render_head, memory_order_acquire) == tail) {
+            // Out of blocks. Play silence and pick up where we left off next time.
+            memset(out, 0, frames * AMY_NCHANS * sizeof(int16_t));
+            atomic_fetch_add_explicit(&render_underruns, 1, memory_order_relaxed);
+            break;
+        }
+        uint32_t n = AMY_BLOCK_SIZE - render_offset;
+        if(n > frames) n = frames;
+        memcpy(out, render_ring[tail % RENDER_RING_BLOCKS].samples + render_offset * AMY_NCHANS, n * AMY_NCHANS * sizeof(int16_t));
+        out += n * AMY_NCHANS;
+        frames -= n;
+        render_offset += n;
+        if(render_offset == AMY_BLOCK_SIZE) {
+            render_offset = 0;
+            tail++;
+            atomic_store_explicit(&render_tail, tail, memory_order_release);
+        }
+    }
+}
+
+// Open the sound device ourselves (the one -d picked, like AMY would) and start rendering ahead
+int render_ahead_start(uint8_t blocks) {
+    if(blocks >= RENDER_RING_BLOCKS) blocks = RENDER_RING_BLOCKS - 1;
+    render_ahead = blocks;
+    if(ma_context_init(NULL, 0, NULL, &render_context) != MA_SUCCESS) {
+        fprintf(stderr, "can't start the audio context\n");
+        render_ahead = 0;
+        return 1;
+    }
+    ma_device_config config = ma_device_config_init(ma_device_type_playback);
+    ma_device_info *playback;
+    ma_uint32 playback_count;
+    if(amy_playback_device_id >= 0) {
+        if(ma_context_get_devices(&render_context, &playback, &playback_count, NULL, NULL) == MA_SUCCESS &&
+                amy_playback_device_id < (int16_t)playback_count) {
+            config.playback.pDeviceID = &playback[amy_playback_device_id].id;
+        } else {
+            fprintf(stderr, "no sound device %d, using the default\n", amy_playback_device_id);
+        }
+    }
+    config.playback.format = ma_format_s16;
+    config.playback.channels = AMY_NCHANS;
+    config.sampleRate = AMY_SAMPLE_RATE;
+    config.periodSizeInFrames = AMY_BLOCK_SIZE;
+    config.dataCallback = render_callback;
+    if(ma_device_init(&render_context, &config, &render_device) != MA_SUCCESS) {
+        fprintf(stderr, "can't open the sound device\n");
+        ma_context_uninit(&render_context);
+        render_ahead = 0;
+        return 1;
+    }
+    // The device takes a period at a time, so the ring needs at least that much in it to ride out anything
+    uint32_t period = render_device.playback.internalPeriodSizeInFrames;
+    if(period > (uint32_t)render_ahead * AMY_BLOCK_SIZE) {
+        fprintf(stderr, "%s wants %" PRIu32 " frames at a time, more than %d blocks ahead holds; use -a %" PRIu32 " or more\n",
+            render_device.playback.name, period, render_ahead, period / AMY_BLOCK_SIZE + 2);
+    }
+    // Fill the ring before the device starts asking
+    pthread_create(&render_thread, NULL, render_task, NULL);
+    while(atomic_load(&render_head) < render_ahead) usleep(1000);
+    if(ma_device_start(&render_device) != MA_SUCCESS) {
+        fprintf(stderr, "can't start the sound device\n");
+        // Parks the render thread, which never sees room in the ring again
+        render_ahead = 0;
+        ma_device_uninit(&render_device);
+        ma_context_uninit(&render_context);
+        return 1;
+    }
+    // Keep our clock on what's playing. The ring stays about full, so that's render_ahead blocks behind AMY.
+    alles_output_delay_ms = (uint16_t)((render_ahead * render_block_us() + 500) / 1000);
+    printf("Rendering %d blocks (%.1f ms) ahead of %s\n", render_ahead, render_ahead * render_block_us() / 1000.0f, render_device.playback.name);
+    return 0;
+}
+
+// Called now and then from the main loop. Quiet unless the ring ran dry or got close to it.
+void render_ahead_report() {
+    static uint32_t last_underruns = 0;
+    static int64_t next_report = 0;
+    if(!render_ahead) return;
+    int64_t now = alles_sysclock_us() / 1000;
+    if(now < next_report) return;
+    next_report = now + RENDER_REPORT_MS;
+    uint32_t underruns = atomic_load(&render_underruns);
+    uint32_t fewest = atomic_exchange(&render_fewest, RENDER_RING_BLOCKS);
+    if(underruns != last_underruns || fewest <= 1) {
+        printf("render ahead: %" PRIu32 " underruns (%" PRIu32 " new), fewest blocks ready %" PRIu32 " of %d, longest render %.0f%% of a block\n",
+            underruns, underruns - last_underruns, fewest, render_ahead, render_peak_us * 100.0f / render_block_us());
+    }
+    last_underruns = underruns;
+    render_peak_us = 0;
+}
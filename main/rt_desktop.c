@@ -0,0 +1,160 @@
+// rt_desktop.c
+// Real-time scheduling, CPU pinning and memory locking for the desktop build, the counterpart of the core
+// pinning and task priorities in alles_esp32.c. The threads we want (miniaudio's and the network's) are
+// started by code we don't own, so we list this process's threads before and after starting them and
+// change whichever ones are new. Linux only; elsewhere the options just say they can't.
+#ifdef __linux__
+#define _GNU_SOURCE // sched_setaffinity
+#endif
+#include "alles.h"
+#ifdef __linux__
+#include <sched.h>
+#include <dirent.h>
+#include <errno.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+
+#define RT_AUDIO_PRIORITY 80   // out of 99, above the network, like ALLES_RENDER_TASK_PRIORITY on the ESP
+#define RT_NETWORK_PRIORITY 70
+#define RT_MAX_THREADS 256
+#define RT_HEAP_PREFAULT (8*1024*1024) // heap we fault in and keep, so later mallocs don't page fault
+
+int rt_policy = 0;        // 0 leaves scheduling alone, else SCHED_FIFO or SCHED_RR
+int rt_audio_cpu = -1;    // core to pin the audio threads to, -1 for any
+int rt_network_cpu = -1;  // same for the listener and parse workers
+uint8_t rt_lock = 0;      // mlockall and prefault
+uint8_t rt_failed = 0;
+long rt_minor_faults = 0, rt_major_faults = 0;
+
+// Parse the -R argument
+int rt_parse_policy(const char *name) {
+#ifdef __linux__
+    if(strcmp(name, "fifo") == 0) return SCHED_FIFO;
+    if(strcmp(name, "rr") == 0) return SCHED_RR;
+#endif
+    fprintf(stderr, "unknown scheduling policy %s, use fifo or rr\n", name);
+    return 0;
+}
+
+// This process's thread ids, from /proc
+int rt_threads(int *tids, int max) {
+    int n = 0;
+#ifdef __linux__
+    DIR *dir = opendir("/proc/self/task");
+    if(dir == NULL) return 0;
+    struct dirent *d;
+    while((d = readdir(dir)) != NULL && n < max) {
+        if(d->d_name[0] == '.') continue;
+        tids[n++] = atoi(d->d_name);
+    }
+    closedir(dir);
+#endif
+    return n;
+}
+
+static void rt_apply(int tid, const char *name, int priority, int cpu) {
+#ifdef __linux__
+    if(rt_policy) {
+        struct sched_param param = { .sched_priority = priority };
+        if(sched_setscheduler(tid, rt_policy, &param) != 0) {
+            fprintf(stderr, "can't make %s thread %d real-time (%s)%s\n", name, tid, strerror(errno),
+                errno == EPERM ? ", needs root, CAP_SYS_NICE or an rtprio limit (ulimit -r)" : "");
+            rt_failed = 1;
+        } else {
+            printf("%s thread %d is %s priority %d\n", name, tid, rt_policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_RR", priority);
+        }
+    }
+    if(cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if(sched_setaffinity(tid, sizeof(set), &set) != 0) {
+            fprintf(stderr, "can't pin %s thread %d to cpu %d (%s)\n", name, tid, cpu, strerror(errno));
+            rt_failed = 1;
+        } else {
+            printf("%s thread %d is on cpu %d\n", name, tid, cpu);
+        }
+    }
+#endif
+}
+
+// Set up every thread that isn't in before[], which rt_threads filled before they were started
+static void rt_apply_new(const int *before, int n_before, const char *name, int priority, int cpu) {
+    int now[RT_MAX_THREADS];
+    int n = rt_threads(now, RT_MAX_THREADS);
+    for(int i=0;i<n;i++) {
+        uint8_t old = 0;
+        for(int j=0;j<n_before && !old;j++) old = (now[i] == before[j]);
+        if(!old) rt_apply(now[i], name, priority, cpu);
+    }
+}
+
+void rt_audio_threads(const int *before, int n_before) {
+    if(rt_policy || rt_audio_cpu >= 0) rt_apply_new(before, n_before, "audio", RT_AUDIO_PRIORITY, rt_audio_cpu);
+}
+
+void rt_network_threads(const int *before, int n_before) {
+    if(rt_policy || rt_network_cpu >= 0) rt_apply_new(before, n_before, "network", RT_NETWORK_PRIORITY, rt_network_cpu);
+}
+
+static void rt_faults(long *minor, long *major) {
+    *minor = 0;
+    *major = 0;
+#ifdef __linux__
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) == 0) {
+        *minor = usage.ru_minflt;
+        *major = usage.ru_majflt;
+    }
+#endif
+}
+
+// Lock everything we have and will have into RAM. Called once AMY has started, so its tables and buffers get
+// faulted in now; anything allocated later (virtual synths, parse workers, thread stacks) is locked as it's made.
+void rt_lock_memory() {
+    if(!rt_lock) return;
+#ifdef __linux__
+    // Keep freed memory rather than handing it back, and serve big allocations from the (locked) heap
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        fprintf(stderr, "can't lock memory (%s)%s\n", strerror(errno),
+            errno == ENOMEM || errno == EPERM ? ", needs root, CAP_IPC_LOCK or a memlock limit (ulimit -l)" : "");
+        rt_failed = 1;
+        return;
+    }
+    char *heap = malloc(RT_HEAP_PREFAULT);
+    if(heap) {
+        for(uint32_t i=0;i<RT_HEAP_PREFAULT;i+=4096) heap[i] = 0;
+        free(heap);
+    }
+    rt_faults(&rt_minor_faults, &rt_major_faults);
+    printf("Memory locked, %ld page faults so far (%ld major)\n", rt_minor_faults + rt_major_faults, rt_major_faults);
+#else
+    fprintf(stderr, "memory locking isn't supported on this platform\n");
+    rt_failed = 1;
+#endif
+}
+
+// Call once every thread has started, then rt_report once we've played something
+void rt_started() {
+    rt_faults(&rt_minor_faults, &rt_major_faults);
+}
+
+// Any page faults since rt_started mean something on the audio path wasn't locked in
+void rt_report() {
+    if(rt_lock && !rt_failed) {
+        long minor, major;
+        rt_faults(&minor, &major);
+        printf("%ld page faults since starting up (%ld major)\n", (minor - rt_minor_faults) + (major - rt_major_faults), major - rt_major_faults);
+    }
+#ifndef __linux__
+    if(rt_policy || rt_audio_cpu >= 0 || rt_network_cpu >= 0) {
+        fprintf(stderr, "real-time scheduling and cpu pinning aren't supported on this platform\n");
+        rt_failed = 1;
+    }
+#endif
+    if(rt_failed) fprintf(stderr, "Some real-time settings didn't take, see above. Running anyway.\n");
+}